@@ -1,36 +1,46 @@
 #include "util/util.h"
 #include "vbench.h"
 #include "vmap.h"
+#include "vmap_define.h"
+#include "vmap_hash.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #ifndef KEY_SIZE
 #define KEY_SIZE 4
 #endif /* KEY_SIZE */
 
+/* lookups timed together per sample by run_bench, a sample is their mean */
+#define FIND_BATCH 100
+
 typedef struct {
     char key[KEY_SIZE + 1];
     int value;
 } key_val;
 
-void init_key_vals(const char* input, size_t input_len);
+void init_key_vals(const char* input, size_t input_len, size_t nthreads);
 
 size_t num_keys = 0;
 key_val* key_vals;
 
 uint64_t hash(const void* k) {
-    uint64_t hash = 5381;
-    char ch;
-    size_t i;
-    const char* my_key = k;
-    for (i = 0; i < KEY_SIZE; ++i) {
-        ch = my_key[i];
-        hash = ((hash << 5) + hash) + ch;
-    }
-    return hash;
+    return vmap_hash_bytes(k, KEY_SIZE);
 }
 
+typedef struct {
+    char k[KEY_SIZE];
+} fixed_key;
+
+static inline uint64_t fixed_key_hash(fixed_key key) {
+    return hash(key.k);
+}
+
+#define fixed_key_eq(a, b) (memcmp((a).k, (b).k, KEY_SIZE) == 0)
+
+VMAP_DEFINE(fixed_map, fixed_key, int, fixed_key_hash, fixed_key_eq)
+
 vmap_type* init_type(void) {
     vmap_type* t = calloc(1, sizeof *t);
     assert(t != NULL);
@@ -40,6 +50,8 @@ vmap_type* init_type(void) {
     return t;
 }
 
+/* looks up the last key put in a len element map, FIND_BATCH lookups per
+ * sample so that reading the clock does not swamp one small map lookup */
 void run_bench(const char* bench_name, size_t len, size_t warmup,
                size_t samples) {
     size_t i;
@@ -59,58 +71,271 @@ void run_bench(const char* bench_name, size_t len, size_t warmup,
     key = key_vals[i].key;
     value = key_vals[i].value;
     assert(vmap_insert(&map, key, &value) == VMAP_OK);
-    BENCH(bench_name, warmup, samples) {
+    BENCH_BATCH(bench_name, warmup, samples, FIND_BATCH) {
         const int* res = vmap_find(map, key);
         BENCH_VOLATILE_REG(res);
     }
     vmap_delete(map);
 }
 
-int main(void) {
-    size_t len = 0;
-    char* file_contents;
+/* looks up random keys of a len element map through vmap_find and through a
+ * map generated by VMAP_DEFINE, timing batch_len lookups per sample */
+void run_define_bench(size_t len, size_t batch_len, size_t samples) {
+    size_t i, pos = 0;
+    vmap* map;
+    fixed_map* fmap;
+    fixed_key* keys;
+    const int* res;
+    static char titles[2][64];
+    assert(len < num_keys);
+    keys = calloc(len, sizeof *keys);
+    assert(keys != NULL);
+    map = vmap_new(init_type());
+    fmap = fixed_map_new();
+    assert(fmap != NULL);
+    for (i = 0; i < len; ++i) {
+        fixed_key key;
+        int res;
+        memcpy(key.k, key_vals[i].key, KEY_SIZE);
+        res = vmap_insert(&map, key.k, &key_vals[i].value);
+        assert(res == VMAP_OK);
+        res = fixed_map_insert(fmap, key, key_vals[i].value);
+        assert(res == VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        memcpy(keys[i].k, key_vals[rand() % len].key, KEY_SIZE);
+    }
+    snprintf(titles[0], sizeof titles[0], "find with %lu elements",
+             (unsigned long)len);
+    BENCH_BATCH(titles[0], 10, samples, batch_len) {
+        res = vmap_find(map, keys[pos].k);
+        BENCH_VOLATILE_REG(res);
+        pos = pos + 1 < len ? pos + 1 : 0;
+    }
+    snprintf(titles[1], sizeof titles[1], "VMAP_DEFINE find with %lu elements",
+             (unsigned long)len);
+    BENCH_BATCH(titles[1], 10, samples, batch_len) {
+        res = fixed_map_find(fmap, keys[pos]);
+        BENCH_VOLATILE_REG(res);
+        pos = pos + 1 < len ? pos + 1 : 0;
+    }
+    vmap_delete(map);
+    fixed_map_delete(fmap);
+    free(keys);
+}
+
+/* looks up batch_len random keys of a len element map per sample, either
+ * one at a time or with vmap_find_batch */
+void run_batch_bench(size_t len, size_t batch_len, size_t samples) {
+    size_t i, pos = 0;
+    vmap* map;
+    const void** keys;
+    const void** out;
+    static char titles[2][64];
+    assert(len < num_keys);
+    keys = calloc(len, sizeof *keys);
+    out = calloc(batch_len, sizeof *out);
+    assert(keys != NULL && out != NULL);
+    map = vmap_new(init_type());
+    for (i = 0; i < len; ++i) {
+        int res = vmap_insert(&map, key_vals[i].key, &key_vals[i].value);
+        assert(res == VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        keys[i] = key_vals[rand() % len].key;
+    }
+    snprintf(titles[0], sizeof titles[0], "find %lu keys with %lu elements",
+             (unsigned long)batch_len, (unsigned long)len);
+    BENCH(titles[0], 10, samples) {
+        for (i = 0; i < batch_len; ++i) {
+            out[i] = vmap_find(map, keys[(pos + i) % len]);
+        }
+        BENCH_VOLATILE_MEM(out[0]);
+        pos = (pos + batch_len) % len;
+    }
+    snprintf(titles[1], sizeof titles[1],
+             "find_batch %lu keys with %lu elements", (unsigned long)batch_len,
+             (unsigned long)len);
+    BENCH(titles[1], 10, samples) {
+        size_t n = batch_len < len - pos ? batch_len : len - pos;
+        vmap_find_batch(map, keys + pos, n, out);
+        BENCH_VOLATILE_MEM(out[0]);
+        pos = (pos + n) % len;
+    }
+    vmap_delete(map);
+    free(keys);
+    free(out);
+}
+
+#if VMAP_BACKWARD_SHIFT
+#define ERASE_MODE "backward shift"
+#else
+#define ERASE_MODE "tombstones"
+#endif /* VMAP_BACKWARD_SHIFT */
+
+/* keeps len keys in the map while replacing step of them per round, timing
+ * lookups of keys that were erased and printing the probe distances and
+ * tombstones the churn has left behind */
+void run_churn_bench(size_t len, size_t step, size_t rounds, size_t samples) {
+    size_t i, round, next = len, miss = 0;
+    vmap* map;
+    vmap_statistics st;
+    static char titles[4][64];
+    assert(len + (step * rounds) < num_keys);
+    map = vmap_new(init_type());
+    for (i = 0; i < len; ++i) {
+        int res = vmap_insert(&map, key_vals[i].key, &key_vals[i].value);
+        assert(res == VMAP_OK);
+    }
+    for (round = 1; round <= rounds; ++round) {
+        char* title;
+        for (i = 0; i < step; ++i) {
+            size_t old = next - len;
+            int res = vmap_erase(&map, key_vals[old].key);
+            assert(res == VMAP_OK);
+            res = vmap_insert(&map, key_vals[next].key, &key_vals[next].value);
+            assert(res == VMAP_OK);
+            next++;
+        }
+        if (round % (rounds / 4) != 0) {
+            continue;
+        }
+        vmap_stats(map, &st);
+        printf("%s, %lu churn rounds: max probe %lu, mean probe %.3f, "
+               "tombstones %lu\n",
+               ERASE_MODE, (unsigned long)round, (unsigned long)st.max_probe,
+               (double)st.total_probe / (double)st.numel,
+               (unsigned long)(st.numelplusdeleted - st.numel));
+        title = titles[(round / (rounds / 4)) - 1];
+        snprintf(title, sizeof titles[0], "find miss after %lu churn rounds",
+                 (unsigned long)round);
+        BENCH(title, 100, samples) {
+            const int* res = vmap_find(map, key_vals[miss].key);
+            BENCH_VOLATILE_REG(res);
+            miss = (miss + 1) % (next - len);
+        }
+    }
+    vmap_delete(map);
+}
+
+/* walks every entry of a len element map */
+void run_iter_bench(size_t len, size_t samples) {
+    size_t i;
+    vmap* map;
+    static char title[64];
+    assert(len < num_keys);
+    map = vmap_new(init_type());
+    for (i = 0; i < len; ++i) {
+        int res = vmap_insert(&map, key_vals[i].key, &key_vals[i].value);
+        assert(res == VMAP_OK);
+    }
+    snprintf(title, sizeof title, "iterate %lu elements", (unsigned long)len);
+    BENCH(title, 2, samples) {
+        vmap_iter it;
+        int sum = 0;
+        vmap_foreach(map, it) {
+            sum += *(const int*)it.value;
+        }
+        BENCH_VOLATILE_REG(sum);
+    }
+    vmap_delete(map);
+}
+
+/* bulk loads every key value into a map the way a preload would */
+void run_load_bench(size_t nthreads) {
+    void** keys = malloc(num_keys * sizeof *keys);
+    void** values = malloc(num_keys * sizeof *values);
+    size_t i;
+    double start;
+    vmap* map;
+    assert(keys != NULL && values != NULL);
+    for (i = 0; i < num_keys; ++i) {
+        keys[i] = key_vals[i].key;
+        values[i] = &key_vals[i].value;
+    }
+    start = bench_monotonic();
+    map = vmap_build(init_type(), keys, values, num_keys, nthreads);
+    assert(map != NULL);
+    printf("vmap_build of %lu key vals on %lu threads: %.3f s\n",
+           (unsigned long)num_keys, (unsigned long)nthreads,
+           bench_monotonic() - start);
+    vmap_delete(map);
+    free(keys);
+    free(values);
+}
+
+/* reads key values from the file named by the first argument, or stdin */
+int main(int argc, char** argv) {
+    mapped_file file;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    double start;
+    int res;
 
     printf("BENCH MARKING %d byte SIZE KEYS\n", KEY_SIZE);
 
-    file_contents = read_file(NULL, &len);
-    assert(file_contents != NULL);
-    init_key_vals(file_contents, len);
-    free(file_contents);
+    start = bench_monotonic();
+    res = map_file(&file, argc > 1 ? argv[1] : NULL);
+    assert(res == 0);
+    init_key_vals(file.data, file.len, nthreads);
+    unmap_file(&file);
+    printf("loaded %lu key vals on %lu threads: %.3f s\n",
+           (unsigned long)num_keys, (unsigned long)nthreads,
+           bench_monotonic() - start);
+    run_load_bench(nthreads);
 
-    run_bench("find with 1 elements 10 times", 1, 100, 10);
-    run_bench("find with 1 elements 100 times", 1, 100, 100);
-    run_bench("find with 1 elements 1000 times", 1, 100, 1000);
-    run_bench("find with 1 elements 10000 times", 1, 100, 10000);
+    run_bench("find with 1 elements, 10 samples", 1, 100, 10);
+    run_bench("find with 1 elements, 100 samples", 1, 100, 100);
+    run_bench("find with 1 elements, 1000 samples", 1, 100, 1000);
+    run_bench("find with 1 elements, 10000 samples", 1, 100, 10000);
     bench_done();
 
-    run_bench("find with 10 elements 10 times", 10, 100, 10);
-    run_bench("find with 10 elements 100 times", 10, 100, 100);
-    run_bench("find with 10 elements 1000 times", 10, 100, 1000);
-    run_bench("find with 10 elements 10000 times", 10, 100, 10000);
+    run_bench("find with 10 elements, 10 samples", 10, 100, 10);
+    run_bench("find with 10 elements, 100 samples", 10, 100, 100);
+    run_bench("find with 10 elements, 1000 samples", 10, 100, 1000);
+    run_bench("find with 10 elements, 10000 samples", 10, 100, 10000);
     bench_done();
 
-    run_bench("find with 100 elements 10 times", 100, 100, 10);
-    run_bench("find with 100 elements 100 times", 100, 100, 100);
-    run_bench("find with 100 elements 1000 times", 100, 100, 1000);
-    run_bench("find with 100 elements 10000 times", 100, 100, 10000);
+    run_bench("find with 100 elements, 10 samples", 100, 100, 10);
+    run_bench("find with 100 elements, 100 samples", 100, 100, 100);
+    run_bench("find with 100 elements, 1000 samples", 100, 100, 1000);
+    run_bench("find with 100 elements, 10000 samples", 100, 100, 10000);
     bench_done();
 
-    run_bench("find with 1000 elements 10 times", 1000, 100, 10);
-    run_bench("find with 1000 elements 100 times", 1000, 100, 100);
-    run_bench("find with 1000 elements 1000 times", 1000, 100, 1000);
-    run_bench("find with 1000 elements 10000 times", 1000, 100, 10000);
+    run_bench("find with 1000 elements, 10 samples", 1000, 100, 10);
+    run_bench("find with 1000 elements, 100 samples", 1000, 100, 100);
+    run_bench("find with 1000 elements, 1000 samples", 1000, 100, 1000);
+    run_bench("find with 1000 elements, 10000 samples", 1000, 100, 10000);
     bench_done();
 
-    run_bench("find with 10000 elements 10 times", 10000, 100, 10);
-    run_bench("find with 10000 elements 100 times", 10000, 100, 100);
-    run_bench("find with 10000 elements 1000 times", 10000, 100, 1000);
-    run_bench("find with 10000 elements 10000 times", 10000, 100, 10000);
+    run_bench("find with 10000 elements, 10 samples", 10000, 100, 10);
+    run_bench("find with 10000 elements, 100 samples", 10000, 100, 100);
+    run_bench("find with 10000 elements, 1000 samples", 10000, 100, 1000);
+    run_bench("find with 10000 elements, 10000 samples", 10000, 100, 10000);
     bench_done();
 
-    run_bench("find with 100000 elements 10 times", 100000, 100, 10);
-    run_bench("find with 100000 elements 100 times", 100000, 100, 100);
-    run_bench("find with 100000 elements 1000 times", 100000, 100, 1000);
-    run_bench("find with 100000 elements 10000 times", 100000, 100, 10000);
+    run_bench("find with 100000 elements, 10 samples", 100000, 100, 10);
+    run_bench("find with 100000 elements, 100 samples", 100000, 100, 100);
+    run_bench("find with 100000 elements, 1000 samples", 100000, 100, 1000);
+    run_bench("find with 100000 elements, 10000 samples", 100000, 100, 10000);
+    bench_done();
+
+    run_define_bench(1000, 64, 10000);
+    bench_done();
+
+    run_define_bench(100000, 64, 10000);
+    bench_done();
+
+    run_churn_bench(100000, 10000, 40, 10000);
+    bench_done();
+
+    run_batch_bench(10000, 64, 10000);
+    bench_done();
+
+    run_batch_bench(900000, 64, 10000);
+    bench_done();
+
+    run_iter_bench(900000, 20);
     bench_done();
 
     free(key_vals);
@@ -119,46 +344,24 @@ int main(void) {
     return 0;
 }
 
-void init_key_vals(const char* input, size_t input_len) {
-    line_iter iter = line_iter_new(input, input_len);
-    size_t kvs_len = 0, kvs_cap = 32;
-    key_vals = calloc(kvs_cap, sizeof *key_vals);
+void parse_key_val(const char* line, size_t len, void* record) {
+    key_val* kv = record;
+    size_t i = 0;
+    memset(kv, 0, sizeof *kv);
+    while (i < len && line[i] != ' ' && i < KEY_SIZE) {
+        kv->key[i] = line[i];
+        i++;
+    }
+    for (i++; i < len; ++i) {
+        kv->value = (kv->value * 10) + (line[i] - '0');
+    }
+}
+
+void init_key_vals(const char* input, size_t input_len, size_t nthreads) {
+    key_vals = parse_lines(input, input_len, nthreads, sizeof *key_vals,
+                           parse_key_val, &num_keys);
     if (key_vals == NULL) {
         fprintf(stderr, "failed to allocate memory for key vals\n");
         exit(1);
     }
-    while (iter.cur) {
-        const char* cur = iter.cur;
-        size_t cur_len = iter.cur_len;
-        size_t i = 0;
-        char ch;
-        key_val kv = {0};
-        if (cur_len == 0) {
-            break;
-        }
-        while ((ch = cur[i]) != ' ' && i < KEY_SIZE) {
-            kv.key[i] = ch;
-            i++;
-        }
-        i++;
-        while ((ch = cur[i]) != '\n') {
-            kv.value = (kv.value * 10) + (ch - '0');
-            i++;
-        }
-        if (kvs_len == kvs_cap) {
-            void* tmp;
-            kvs_cap <<= 1;
-            tmp = realloc(key_vals, kvs_cap * (sizeof *key_vals));
-            if (tmp == NULL) {
-                free(key_vals);
-                fprintf(stderr, "failed to allocate memory for key vals\n");
-                exit(1);
-            }
-            key_vals = tmp;
-        }
-        key_vals[kvs_len] = kv;
-        kvs_len++;
-        line_iter_next(&iter);
-    }
-    num_keys = kvs_len;
 }
@@ -0,0 +1,250 @@
+#include "vmap_concurrent.h"
+#include "vmap_sharded.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_KEYS (1 << 20)
+#define FINDS_PER_READER 5000000
+
+typedef struct {
+    vmap_concurrent* map;
+    uint64_t seed;
+    uint64_t found;
+} reader_args;
+
+static volatile int writer_done = 0;
+
+uint64_t hash(const void* k) {
+    uint64_t x;
+    memcpy(&x, k, sizeof x);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+vmap_type* init_type(void) {
+    vmap_type* t = calloc(1, sizeof *t);
+    assert(t != NULL);
+    t->hash = hash;
+    t->key_size = sizeof(uint64_t);
+    t->value_size = sizeof(uint64_t);
+    return t;
+}
+
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void* reader(void* data) {
+    reader_args* args = data;
+    vmap_reader* r = vmap_reader_register(args->map);
+    uint64_t i, x = args->seed;
+    assert(r != NULL);
+    for (i = 0; i < FINDS_PER_READER; ++i) {
+        uint64_t k;
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        k = (x >> 33) % NUM_KEYS;
+        vmap_read_begin(r);
+        if (vmap_concurrent_find(args->map, &k) != NULL) {
+            args->found++;
+        }
+        vmap_read_end(r);
+    }
+    vmap_reader_unregister(r);
+    return NULL;
+}
+
+/* keeps replacing values and churning a key range the readers never ask
+ * for, so tables and entries are retired while the readers run */
+void* writer(void* data) {
+    vmap_concurrent* map = data;
+    uint64_t i = 0;
+    while (!writer_done) {
+        uint64_t k = i % NUM_KEYS;
+        uint64_t churn = NUM_KEYS + (i % 1024);
+        int res = vmap_concurrent_insert(map, &k, &i);
+        assert(res == VMAP_OK);
+        res = vmap_concurrent_insert(map, &churn, &i);
+        assert(res == VMAP_OK);
+        res = vmap_concurrent_erase(map, &churn);
+        assert(res == VMAP_OK);
+        i++;
+    }
+    return NULL;
+}
+
+void run_bench(vmap_concurrent* map, size_t num_readers) {
+    pthread_t writer_thread;
+    pthread_t* threads = calloc(num_readers, sizeof *threads);
+    reader_args* args = calloc(num_readers, sizeof *args);
+    double start, elapsed;
+    size_t i;
+    assert(threads != NULL && args != NULL);
+    writer_done = 0;
+    pthread_create(&writer_thread, NULL, writer, map);
+    start = now();
+    for (i = 0; i < num_readers; ++i) {
+        args[i].map = map;
+        args[i].seed = i + 1;
+        pthread_create(&threads[i], NULL, reader, &args[i]);
+    }
+    for (i = 0; i < num_readers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now() - start;
+    writer_done = 1;
+    pthread_join(writer_thread, NULL);
+    printf("%2lu readers: %8.2f Mfinds/s total, %8.2f Mfinds/s per reader\n",
+           (unsigned long)num_readers,
+           (num_readers * FINDS_PER_READER) / elapsed / 1e6,
+           FINDS_PER_READER / elapsed / 1e6);
+    free(threads);
+    free(args);
+}
+
+typedef struct {
+    vmap_sharded* map;
+    uint64_t start;
+    uint64_t len;
+} inserter_args;
+
+void* inserter(void* data) {
+    inserter_args* args = data;
+    uint64_t i;
+    for (i = args->start; i < args->start + args->len; ++i) {
+        int res = vmap_sharded_insert(args->map, &i, &i);
+        assert(res == VMAP_OK);
+    }
+    return NULL;
+}
+
+void run_sharded_bench(size_t num_shards, size_t num_threads) {
+    vmap_sharded* map = vmap_sharded_new(init_type(), num_shards);
+    pthread_t* threads = calloc(num_threads, sizeof *threads);
+    inserter_args* args = calloc(num_threads, sizeof *args);
+    uint64_t per_thread = NUM_KEYS / num_threads;
+    double start, elapsed;
+    size_t i;
+    assert(map != NULL && threads != NULL && args != NULL);
+    start = now();
+    for (i = 0; i < num_threads; ++i) {
+        args[i].map = map;
+        args[i].start = i * per_thread;
+        args[i].len = per_thread;
+        pthread_create(&threads[i], NULL, inserter, &args[i]);
+    }
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = now() - start;
+    printf("%3lu shards %2lu writers: %8.2f Minserts/s\n",
+           (unsigned long)num_shards, (unsigned long)num_threads,
+           (per_thread * num_threads) / elapsed / 1e6);
+    vmap_sharded_delete(map);
+    free(threads);
+    free(args);
+}
+
+/* builds a map of 8 * NUM_KEYS keys with vmap_build, against inserting
+ * them one by one when num_threads is 0 */
+void run_build_bench(size_t num_threads) {
+    size_t i, n = (size_t)NUM_KEYS * 8;
+    uint64_t* data = malloc(n * sizeof *data);
+    void** keys = malloc(n * sizeof *keys);
+    vmap* map;
+    double start, elapsed;
+    assert(data != NULL && keys != NULL);
+    for (i = 0; i < n; ++i) {
+        data[i] = i * 0x9e3779b97f4a7c15ULL;
+        keys[i] = &data[i];
+    }
+    start = now();
+    if (num_threads == 0) {
+        map = vmap_new(init_type());
+        assert(map != NULL);
+        for (i = 0; i < n; ++i) {
+            int res = vmap_insert(&map, keys[i], keys[i]);
+            assert(res == VMAP_OK);
+        }
+    } else {
+        map = vmap_build(init_type(), keys, keys, n, num_threads);
+        assert(map != NULL);
+    }
+    elapsed = now() - start;
+    if (num_threads == 0) {
+        printf("  vmap_insert: %8.2f Minserts/s\n", n / elapsed / 1e6);
+    } else {
+        printf("%2lu threads: %8.2f Minserts/s\n", (unsigned long)num_threads,
+               n / elapsed / 1e6);
+    }
+    vmap_delete(map);
+    free(data);
+    free(keys);
+}
+
+/* inserts 8 * NUM_KEYS keys one by one with resizes spread over
+ * num_threads threads */
+void run_resize_bench(size_t num_threads) {
+    vmap_type* t = init_type();
+    vmap* map;
+    uint64_t i, n = (uint64_t)NUM_KEYS * 8;
+    double start, elapsed;
+    t->resize_threads = num_threads;
+    map = vmap_new(t);
+    assert(map != NULL);
+    start = now();
+    for (i = 0; i < n; ++i) {
+        uint64_t k = i * 0x9e3779b97f4a7c15ULL;
+        int res = vmap_insert(&map, &k, &i);
+        assert(res == VMAP_OK);
+    }
+    elapsed = now() - start;
+    printf("%2lu resize threads: %8.2f Minserts/s\n",
+           (unsigned long)num_threads, n / elapsed / 1e6);
+    vmap_delete(map);
+}
+
+int main(void) {
+    vmap_concurrent* map = vmap_concurrent_new(init_type());
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t i;
+    size_t n;
+    assert(map != NULL);
+    for (i = 0; i < NUM_KEYS; ++i) {
+        int res = vmap_concurrent_insert(map, &i, &i);
+        assert(res == VMAP_OK);
+    }
+    printf("BENCH MARKING concurrent finds with 1 writer, %d keys\n",
+           NUM_KEYS);
+    for (n = 1; n < (size_t)ncpus; n <<= 1) {
+        run_bench(map, n);
+    }
+    run_bench(map, ncpus > 1 ? (size_t)ncpus - 1 : 1);
+    vmap_concurrent_delete(map);
+
+    printf("BENCH MARKING sharded inserts, %d keys\n", NUM_KEYS);
+    for (n = 1; n <= (size_t)ncpus; n <<= 1) {
+        run_sharded_bench(1, n);
+        run_sharded_bench(64, n);
+    }
+
+    printf("BENCH MARKING vmap_build, %d keys\n", NUM_KEYS * 8);
+    run_build_bench(0);
+    for (n = 1; n <= (size_t)ncpus; n <<= 1) {
+        run_build_bench(n);
+    }
+
+    printf("BENCH MARKING inserts with threaded resizes, %d keys\n",
+           NUM_KEYS * 8);
+    for (n = 1; n <= (size_t)ncpus; n <<= 1) {
+        run_resize_bench(n);
+    }
+    return 0;
+}
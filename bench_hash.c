@@ -0,0 +1,161 @@
+#include "vmap_hash.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BUF_SIZE (1 << 24)
+#define TABLE_POWER 20
+
+typedef struct {
+    const char* name;
+    uint64_t (*hash)(const void* data, size_t len);
+} hash_fn;
+
+static uint64_t djb2(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint64_t hash = 5381;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash = ((hash << 5) + hash) + p[i];
+    }
+    return hash;
+}
+
+static uint64_t bytes(const void* data, size_t len) {
+    return vmap_hash_bytes(data, len);
+}
+
+static uint64_t crc32(const void* data, size_t len) {
+    return vmap_hash_crc32(data, len);
+}
+
+/* only meant for 8 byte keys */
+static uint64_t u64(const void* data, size_t len) {
+    uint64_t k;
+    (void)len;
+    memcpy(&k, data, sizeof k);
+    return vmap_hash_u64(k);
+}
+
+static const hash_fn hash_fns[] = {
+    {"djb2", djb2},
+    {"vmap_hash_bytes", bytes},
+    {"vmap_hash_crc32", crc32},
+    {"vmap_hash_u64", u64},
+};
+
+#define NUM_HASH_FNS (sizeof hash_fns / sizeof hash_fns[0])
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* hashes every key_size bytes of buf in turn, several passes over it */
+static void run_throughput(const hash_fn* fn, const unsigned char* buf,
+                           size_t key_size) {
+    size_t i, pass, passes = key_size < 64 ? 4 : 16;
+    volatile uint64_t sink = 0;
+    uint64_t acc = 0;
+    double start = now(), secs;
+    for (pass = 0; pass < passes; ++pass) {
+        for (i = 0; i + key_size <= BUF_SIZE; i += key_size) {
+            acc += fn->hash(buf + i, key_size);
+        }
+    }
+    secs = now() - start;
+    sink = acc;
+    (void)sink;
+    printf("%-16s %6lu bytes: %8.3f GB/s\n", fn->name, (unsigned long)key_size,
+           (double)passes * BUF_SIZE / secs / 1e9);
+}
+
+static const hash_fn* cur_hash;
+
+static uint64_t var_key_hash(const void* key) {
+    const vmap_key* k = key;
+    return cur_hash->hash(k->data, k->len);
+}
+
+/* fills a vmap sized for 1 << TABLE_POWER slots to VMAP_MAX_LOAD and
+ * prints how far each key ended up from its home slot */
+static void run_probe_lengths(const hash_fn* fn, const char* key_set,
+                              int strings) {
+    size_t cap = (size_t)1 << TABLE_POWER, i, n;
+    vmap_type* t = calloc(1, sizeof *t);
+    vmap_statistics st;
+    vmap* map;
+    assert(t != NULL);
+    t->hash = var_key_hash;
+    t->key_size = VMAP_VAR_KEYS;
+    t->value_size = sizeof(size_t);
+    cur_hash = fn;
+    n = (size_t)(cap * VMAP_MAX_LOAD);
+    map = vmap_new_with_capacity(t, n);
+    assert(map != NULL);
+    for (i = 0; i < n; ++i) {
+        char buf[32];
+        uint64_t k = i;
+        vmap_key key;
+        int res;
+        key.data = buf;
+        key.len = sizeof k;
+        if (strings) {
+            key.len = (size_t)snprintf(buf, sizeof buf, "key%lu",
+                                       (unsigned long)i);
+        } else {
+            memcpy(buf, &k, sizeof k);
+        }
+        res = vmap_insert(&map, &key, &i);
+        assert(res == VMAP_OK);
+    }
+    vmap_stats(map, &st);
+    printf("%-16s %-8s max %7lu |", fn->name, key_set,
+           (unsigned long)st.max_probe);
+    for (i = 0; i < VMAP_PROBE_BUCKETS; i += 2) {
+        printf(" %5.1f%%",
+               100.0 * (st.probe_histogram[i] + st.probe_histogram[i + 1]) /
+                   st.numel);
+    }
+    printf("\n");
+    vmap_delete(map);
+    free(t);
+}
+
+int main(void) {
+    static const size_t key_sizes[] = {4, 8, 16, 32, 64, 256, 4096};
+    unsigned char* buf = malloc(BUF_SIZE);
+    size_t i, j;
+    assert(buf != NULL);
+    srand(1);
+    for (i = 0; i < BUF_SIZE; ++i) {
+        buf[i] = (unsigned char)rand();
+    }
+
+    printf("hw crc32: %s\n\n", VMAP_HASH_HW_CRC32 ? "yes" : "no");
+    for (i = 0; i < sizeof key_sizes / sizeof key_sizes[0]; ++i) {
+        for (j = 0; j < NUM_HASH_FNS; ++j) {
+            if ((hash_fns[j].hash == u64) && (key_sizes[i] != 8)) {
+                continue;
+            }
+            run_throughput(&hash_fns[j], buf, key_sizes[i]);
+        }
+        printf("\n");
+    }
+
+    printf("probe lengths at load %.2f, buckets 0-1, 2-3, ..., 14+\n",
+           VMAP_MAX_LOAD);
+    for (j = 0; j < NUM_HASH_FNS; ++j) {
+        run_probe_lengths(&hash_fns[j], "ints", 0);
+    }
+    for (j = 0; j < NUM_HASH_FNS; ++j) {
+        if (hash_fns[j].hash != u64) {
+            run_probe_lengths(&hash_fns[j], "strings", 1);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
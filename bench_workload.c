@@ -0,0 +1,352 @@
+#include "vmap.h"
+#include "vmap_hash.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN_ELEMENTS (1 << 8)
+#define MAX_ELEMENTS (1 << 22)
+/* every workload runs at least this many operations, over several maps
+ * when the map itself is smaller */
+#define MIN_OPS (1 << 20)
+#define REPEATS 3
+#define ZIPF_THETA 0.99
+/* marks a write in a mixed workload's op stream */
+#define WRITE_OP UINT64_MAX
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF } dist;
+
+static const char* dist_names[] = {"uniform", "zipf"};
+
+typedef struct {
+    const char* workload;
+    dist d;
+    size_t elements;
+    size_t ops;
+    double secs;
+    size_t bytes;
+} result;
+
+static int json = 0;
+static size_t num_results = 0;
+static uint64_t rng_state = 1;
+static volatile uint64_t sink;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* splitmix64 */
+static uint64_t rng(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static double rng_unit(void) { return (rng() >> 11) * 0x1.0p-53; }
+
+/* distinct ids give distinct keys that look random */
+static inline uint64_t key_of(uint64_t id) {
+    return id * 0x9e3779b97f4a7c15ULL;
+}
+
+static vmap_type* init_type(void) {
+    vmap_type* t = calloc(1, sizeof *t);
+    assert(t != NULL);
+    t->hash = vmap_hash_key_u64;
+    t->key_size = sizeof(uint64_t);
+    t->value_size = sizeof(uint64_t);
+    return t;
+}
+
+/* the map takes ownership of its type, so every map gets a new one */
+static vmap* fill_map(size_t n) {
+    vmap* map = vmap_new(init_type());
+    uint64_t i;
+    assert(map != NULL);
+    for (i = 0; i < n; ++i) {
+        uint64_t k = key_of(i);
+        int res = vmap_insert(&map, &k, &i);
+        assert(res == VMAP_OK);
+    }
+    return map;
+}
+
+static size_t map_bytes(vmap* map) {
+    vmap_statistics st;
+    vmap_stats(map, &st);
+    return st.bytes;
+}
+
+/* fills ranks with ops ranks in [0, n), rank 0 being the most popular one
+ * under DIST_ZIPF. zipf samples follow Gray et al., "Quickly generating
+ * billion-record synthetic databases", as YCSB does */
+static void gen_ranks(uint64_t* ranks, size_t ops, size_t n, dist d) {
+    double zetan = 0, zeta2, alpha, eta;
+    size_t i;
+    if (d == DIST_UNIFORM) {
+        for (i = 0; i < ops; ++i) {
+            ranks[i] = rng() % n;
+        }
+        return;
+    }
+    for (i = 1; i <= n; ++i) {
+        zetan += 1.0 / pow((double)i, ZIPF_THETA);
+    }
+    zeta2 = 1.0 + 1.0 / pow(2.0, ZIPF_THETA);
+    alpha = 1.0 / (1.0 - ZIPF_THETA);
+    eta = (1.0 - pow(2.0 / n, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / zetan);
+    for (i = 0; i < ops; ++i) {
+        double u = rng_unit(), uz = u * zetan;
+        uint64_t r;
+        if (uz < 1.0) {
+            r = 0;
+        } else if (uz < 1.0 + pow(0.5, ZIPF_THETA)) {
+            r = 1;
+        } else {
+            r = (uint64_t)(n * pow(eta * u - eta + 1.0, alpha));
+        }
+        ranks[i] = r < n ? r : n - 1;
+    }
+}
+
+static void report(const result* r) {
+    double ns = r->secs * 1e9 / r->ops;
+    if (json) {
+        printf("%s  {\"workload\": \"%s\", \"dist\": \"%s\", "
+               "\"elements\": %lu, \"ops\": %lu, \"ns_per_op\": %.3f, "
+               "\"ops_per_sec\": %.0f, \"bytes\": %lu}",
+               num_results ? ",\n" : "", r->workload, dist_names[r->d],
+               (unsigned long)r->elements, (unsigned long)r->ops, ns,
+               r->ops / r->secs, (unsigned long)r->bytes);
+    } else {
+        printf("%s,%s,%lu,%lu,%.3f,%.0f,%lu\n", r->workload, dist_names[r->d],
+               (unsigned long)r->elements, (unsigned long)r->ops, ns,
+               r->ops / r->secs, (unsigned long)r->bytes);
+    }
+    num_results++;
+}
+
+/* inserts n keys into fresh maps, resizes included */
+static void run_insert(size_t n, result* r) {
+    size_t round, rounds = (MIN_OPS + n - 1) / n;
+    r->secs = 0;
+    for (round = 0; round < rounds; ++round) {
+        double start = now();
+        vmap* map = fill_map(n);
+        r->secs += now() - start;
+        r->bytes = map_bytes(map);
+        vmap_delete(map);
+    }
+    r->ops = rounds * n;
+}
+
+/* erases every key of n element maps in random order, shrinks included */
+static void run_erase(size_t n, result* r) {
+    size_t i, round, rounds = (MIN_OPS + n - 1) / n;
+    uint64_t* order = malloc(n * sizeof *order);
+    assert(order != NULL);
+    for (i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    for (i = n - 1; i > 0; --i) {
+        size_t j = rng() % (i + 1);
+        uint64_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    r->secs = 0;
+    for (round = 0; round < rounds; ++round) {
+        vmap* map = fill_map(n);
+        double start;
+        r->bytes = map_bytes(map);
+        start = now();
+        for (i = 0; i < n; ++i) {
+            uint64_t k = key_of(order[i]);
+            int res = vmap_erase(&map, &k);
+            assert(res == VMAP_OK);
+        }
+        r->secs += now() - start;
+        vmap_delete(map);
+    }
+    r->ops = rounds * n;
+    free(order);
+}
+
+/* looks up keys of an n element map, or keys it does not hold when miss is
+ * set */
+static void run_find(size_t n, int miss, result* r) {
+    size_t i, ops = n > MIN_OPS ? n : MIN_OPS;
+    uint64_t* ranks = malloc(ops * sizeof *ranks);
+    uint64_t base = miss ? n : 0, found = 0;
+    vmap* map = fill_map(n);
+    double start;
+    assert(ranks != NULL);
+    gen_ranks(ranks, ops, n, r->d);
+    start = now();
+    for (i = 0; i < ops; ++i) {
+        uint64_t k = key_of(base + ranks[i]);
+        found += vmap_find(map, &k) != NULL;
+    }
+    r->secs = now() - start;
+    assert(found == (miss ? 0 : ops));
+    sink = found;
+    r->ops = ops;
+    r->bytes = map_bytes(map);
+    vmap_delete(map);
+    free(ranks);
+}
+
+/* keeps a window of the n most recently inserted keys. reads_pct percent of
+ * the ops look up a key of the window, ranked from the newest one, and the
+ * rest alternate between inserting a new key and erasing the oldest one */
+static void run_mixed(size_t n, unsigned reads_pct, result* r) {
+    size_t i, ops = n > MIN_OPS ? n : MIN_OPS;
+    uint64_t* stream = malloc(ops * sizeof *stream);
+    uint64_t next = n, oldest = 0, found = 0, reads = 0;
+    vmap* map = fill_map(n);
+    double start;
+    assert(stream != NULL);
+    gen_ranks(stream, ops, n, r->d);
+    for (i = 0; i < ops; ++i) {
+        if (rng() % 100 >= reads_pct) {
+            stream[i] = WRITE_OP;
+        }
+    }
+    start = now();
+    for (i = 0; i < ops; ++i) {
+        uint64_t k;
+        int res;
+        if (stream[i] != WRITE_OP) {
+            k = key_of(next - 1 - stream[i]);
+            found += vmap_find(map, &k) != NULL;
+            reads++;
+        } else if (next - oldest == n) {
+            k = key_of(next);
+            res = vmap_insert(&map, &k, &next);
+            assert(res == VMAP_OK);
+            next++;
+        } else {
+            k = key_of(oldest);
+            res = vmap_erase(&map, &k);
+            assert(res == VMAP_OK);
+            oldest++;
+        }
+    }
+    r->secs = now() - start;
+    assert(found == reads);
+    sink = found;
+    r->ops = ops;
+    r->bytes = map_bytes(map);
+    vmap_delete(map);
+    free(stream);
+}
+
+/* counts occurrences of keys of n ids in a map that starts empty, with
+ * vmap_get_or_insert when upsert is set and otherwise with vmap_find
+ * followed by vmap_insert */
+static void run_count(size_t n, int upsert, result* r) {
+    size_t i, ops = n > MIN_OPS ? n : MIN_OPS;
+    uint64_t* ranks = malloc(ops * sizeof *ranks);
+    vmap* map = vmap_new(init_type());
+    double start;
+    assert(ranks != NULL && map != NULL);
+    gen_ranks(ranks, ops, n, r->d);
+    start = now();
+    for (i = 0; i < ops; ++i) {
+        uint64_t k = key_of(ranks[i]);
+        if (upsert) {
+            uint64_t* count = vmap_get_or_insert(&map, &k, NULL);
+            assert(count != NULL);
+            (*count)++;
+        } else {
+            const uint64_t* found = vmap_find(map, &k);
+            uint64_t count = found ? *found + 1 : 1;
+            int res = vmap_insert(&map, &k, &count);
+            assert(res == VMAP_OK);
+        }
+    }
+    r->secs = now() - start;
+    r->ops = ops;
+    r->bytes = map_bytes(map);
+    vmap_delete(map);
+    free(ranks);
+}
+
+/* runs a workload REPEATS times and reports the fastest */
+static void run(const char* workload, dist d, size_t n) {
+    result best = {0}, r;
+    size_t rep;
+    for (rep = 0; rep < REPEATS; ++rep) {
+        memset(&r, 0, sizeof r);
+        r.workload = workload;
+        r.d = d;
+        r.elements = n;
+        if (strcmp(workload, "insert") == 0) {
+            run_insert(n, &r);
+        } else if (strcmp(workload, "erase") == 0) {
+            run_erase(n, &r);
+        } else if (strcmp(workload, "find_hit") == 0) {
+            run_find(n, 0, &r);
+        } else if (strcmp(workload, "find_miss") == 0) {
+            run_find(n, 1, &r);
+        } else if (strcmp(workload, "mixed_90") == 0) {
+            run_mixed(n, 90, &r);
+        } else if (strcmp(workload, "mixed_50") == 0) {
+            run_mixed(n, 50, &r);
+        } else if (strcmp(workload, "count_find_insert") == 0) {
+            run_count(n, 0, &r);
+        } else if (strcmp(workload, "count_get_or_insert") == 0) {
+            run_count(n, 1, &r);
+        } else {
+            run_mixed(n, 0, &r);
+        }
+        if (rep == 0 || r.secs / r.ops < best.secs / best.ops) {
+            best = r;
+        }
+    }
+    report(&best);
+}
+
+int main(int argc, char** argv) {
+    static const char* keyed[] = {"find_hit",          "find_miss",
+                                  "mixed_90",          "mixed_50",
+                                  "churn",             "count_find_insert",
+                                  "count_get_or_insert"};
+    size_t i, n, max_elements = MAX_ELEMENTS;
+    for (i = 1; i < (size_t)argc; ++i) {
+        if (strcmp(argv[i], "-j") == 0) {
+            json = 1;
+        } else if ((max_elements = strtoul(argv[i], NULL, 10)) == 0) {
+            fprintf(stderr, "usage: %s [-j] [max elements]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("workload,dist,elements,ops,ns_per_op,ops_per_sec,bytes\n");
+    }
+    for (n = MIN_ELEMENTS; n <= max_elements; n <<= 2) {
+        run("insert", DIST_UNIFORM, n);
+        run("erase", DIST_UNIFORM, n);
+        for (i = 0; i < sizeof keyed / sizeof keyed[0]; ++i) {
+            run(keyed[i], DIST_UNIFORM, n);
+            run(keyed[i], DIST_ZIPF, n);
+        }
+        fflush(stdout);
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+
+    return 0;
+}
@@ -1,27 +1,63 @@
 #!/usr/bin/env python3
+import csv
+import json
 import sys
 import matplotlib.pyplot as plt
 
-four_byte_keys = []
-sixty_four_byte_keys = []
-amts = []
-
-num_ones = 0
-
-for line in sys.stdin:
-    line = line.strip()
-    s = line.split(" ")
-    amt = int(s[0])
-    time = float(s[1])
-    if amt == 1:
-        num_ones += 1
-    if num_ones < 2:
-        amts.append(amt)
-        four_byte_keys.append(time)
-    else:
-        sixty_four_byte_keys.append(time)
-
-plt.plot(amts, four_byte_keys)
-plt.xscale("log")
+# plots ns per op against table size for every workload and key distribution
+# in vmap_bench_workload's csv or json output, or only for the workloads
+# named on the command line. input that is neither is taken to be lines of
+# "<elements> <seconds>" from graph_bench.sh
+
+
+def plot_workloads(rows, workloads):
+    lines = {}
+    for row in rows:
+        if workloads and row["workload"] not in workloads:
+            continue
+        key = row["workload"] + " " + row["dist"]
+        lines.setdefault(key, []).append(
+            (int(row["elements"]), float(row["ns_per_op"]))
+        )
+    for key, points in lines.items():
+        points.sort()
+        plt.plot([p[0] for p in points], [p[1] for p in points], label=key)
+    plt.xscale("log", base=2)
+    plt.xlabel("elements")
+    plt.ylabel("ns per op")
+    plt.legend()
+
+
+def plot_find_times(lines):
+    four_byte_keys = []
+    sixty_four_byte_keys = []
+    amts = []
+
+    num_ones = 0
+
+    for line in lines:
+        line = line.strip()
+        s = line.split(" ")
+        amt = int(s[0])
+        time = float(s[1])
+        if amt == 1:
+            num_ones += 1
+        if num_ones < 2:
+            amts.append(amt)
+            four_byte_keys.append(time)
+        else:
+            sixty_four_byte_keys.append(time)
+
+    plt.plot(amts, four_byte_keys)
+    plt.xscale("log")
+
+
+data = sys.stdin.read()
+if data.lstrip().startswith("["):
+    plot_workloads(json.loads(data), sys.argv[1:])
+elif data.startswith("workload,"):
+    plot_workloads(csv.DictReader(data.splitlines()), sys.argv[1:])
+else:
+    plot_find_times(data.splitlines())
 
 plt.show()
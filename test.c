@@ -1,6 +1,12 @@
 #include "vmap.h"
+#include "vmap_alloc.h"
+#include "vmap_concurrent.h"
+#include "vmap_define.h"
+#include "vmap_hash.h"
+#include "vmap_sharded.h"
 #include "vtest.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 #define KEY_SIZE 100
@@ -13,15 +19,7 @@ typedef struct {
 } key_val;
 
 uint64_t hash(const void* k) {
-    uint64_t hash = 5381;
-    char ch;
-    size_t i;
-    char* my_key = (char*)k;
-    for (i = 0; i < KEY_SIZE; ++i) {
-        ch = my_key[i];
-        hash = ((hash << 5) + hash) + ch;
-    }
-    return hash;
+    return vmap_hash_bytes(k, KEY_SIZE);
 }
 
 vmap_type* init_type(void) {
@@ -77,8 +75,1433 @@ TEST(it_works) {
     vmap_delete(map);
 }
 
+TEST(resize) {
+    vmap* map = vmap_new(init_type());
+    size_t i, len = 10000;
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = i;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    for (i = 0; i < len; i += 2) {
+        key k = {0};
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_erase(&map, k), VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        const int* res;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        res = vmap_find(map, k);
+        if (i & 1) {
+            vassert(res != NULL);
+            if (res) {
+                vassert_int_eq(*res, (int)i);
+            }
+        } else {
+            vassert(res == NULL);
+        }
+    }
+    vmap_delete(map);
+}
+
+uint64_t collide_hash(const void* k) {
+    (void)k;
+    return 42;
+}
+
+TEST(collisions) {
+    vmap_type* t = init_type();
+    vmap* map;
+    size_t i, len = 200;
+    t->hash = collide_hash;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = i;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    for (i = 0; i < len; i += 3) {
+        key k = {0};
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_erase(&map, k), VMAP_OK);
+        vassert_int_eq(vmap_erase(&map, k), VMAP_NO_KEY);
+    }
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        const int* res;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        res = vmap_find(map, k);
+        if (i % 3 == 0) {
+            vassert(res == NULL);
+        } else {
+            vassert(res != NULL);
+            if (res) {
+                vassert_int_eq(*res, (int)i);
+            }
+        }
+    }
+    vmap_delete(map);
+}
+
+TEST(incremental_resize) {
+    vmap_type* t = init_type();
+    vmap* map;
+    size_t i, len = 5000;
+    t->resize_step = 4;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = i;
+        const int* res;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+        snprintf(k, sizeof k, "key%lu", (unsigned long)(i / 2));
+        res = vmap_find(map, k);
+        vassert(res != NULL);
+        if (res) {
+            vassert_int_eq(*res, (int)(i / 2));
+        }
+    }
+    for (i = 0; i < len; i += 2) {
+        key k = {0};
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_erase(&map, k), VMAP_OK);
+    }
+    while (vmap_resize_step(map, 16))
+        ;
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        const int* res;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        res = vmap_find(map, k);
+        if (i & 1) {
+            vassert(res != NULL);
+        } else {
+            vassert(res == NULL);
+        }
+    }
+    vmap_delete(map);
+}
+
+uint64_t clustered_hash(const void* k) {
+    return hash(k) % 61;
+}
+
+TEST(churn) {
+    vmap_type* t = init_type();
+    vmap* map;
+    size_t i, window = 40, len = 2000;
+    t->hash = clustered_hash;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = i;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+        if (i >= window) {
+            size_t j;
+            snprintf(k, sizeof k, "%lu", (unsigned long)(i - window));
+            vassert_int_eq(vmap_erase(&map, k), VMAP_OK);
+            for (j = i - window + 1; j <= i; ++j) {
+                const int* res;
+                snprintf(k, sizeof k, "%lu", (unsigned long)j);
+                res = vmap_find(map, k);
+                vassert(res != NULL);
+                if (res) {
+                    vassert_int_eq(*res, (int)j);
+                }
+            }
+        }
+    }
+    vmap_delete(map);
+}
+
+/* keeps window long keys alive while inserting and erasing many more, with
+ * and without incremental resizing. the dead keys must not pile up in the
+ * key arena */
+TEST(var_keys_churn) {
+    size_t pass;
+    for (pass = 0; pass < 2; ++pass) {
+        vmap_type* t = init_type();
+        vmap* map;
+        vmap_statistics st;
+        char buf[64];
+        size_t i, window = 1000, steps = 200000, filled = 0;
+        vmap_key k;
+        t->hash = vmap_hash_key_var;
+        t->key_size = VMAP_VAR_KEYS;
+        t->resize_step = pass ? 4 : 0;
+        map = vmap_new(t);
+        k.data = buf;
+        for (i = 0; i < window + steps; ++i) {
+            int value = (int)i;
+            k.len =
+                (size_t)snprintf(buf, sizeof buf, "%040lu", (unsigned long)i);
+            vassert_int_eq(vmap_insert(&map, &k, &value), VMAP_OK);
+            if (i < window) {
+                continue;
+            }
+            k.len = (size_t)snprintf(buf, sizeof buf, "%040lu",
+                                     (unsigned long)(i - window));
+            vassert_int_eq(vmap_erase(&map, &k), VMAP_OK);
+            if (i == 2 * window) {
+                vmap_stats(map, &st);
+                filled = st.bytes;
+            }
+        }
+        vmap_stats(map, &st);
+        vassert(st.numel == window);
+        vassert(st.bytes < 2 * filled);
+        for (i = steps; i < window + steps; ++i) {
+            k.len =
+                (size_t)snprintf(buf, sizeof buf, "%040lu", (unsigned long)i);
+            vassert_int_eq(*(const int*)vmap_find(map, &k), (int)i);
+        }
+        vmap_delete(map);
+    }
+}
+
+void fill_maps(vmap_allocator* allocator, size_t num_maps, size_t len) {
+    size_t i, j;
+    vmap** maps = calloc(num_maps, sizeof *maps);
+    assert(maps != NULL);
+    for (i = 0; i < num_maps; ++i) {
+        vmap_type* t = init_type();
+        t->allocator = allocator;
+        maps[i] = vmap_new(t);
+        vassert_ptr_nonnull(maps[i]);
+        for (j = 0; j < len + i; ++j) {
+            key k = {0};
+            int value = j;
+            snprintf(k, sizeof k, "%lu", (unsigned long)j);
+            vassert_int_eq(vmap_insert(&maps[i], k, &value), VMAP_OK);
+        }
+    }
+    for (i = 0; i < num_maps; ++i) {
+        for (j = 0; j < len + i; ++j) {
+            key k = {0};
+            const int* res;
+            snprintf(k, sizeof k, "%lu", (unsigned long)j);
+            res = vmap_find(maps[i], k);
+            vassert(res != NULL);
+            if (res) {
+                vassert_int_eq(*res, (int)j);
+            }
+        }
+        vmap_delete(maps[i]);
+    }
+    free(maps);
+}
+
+TEST(slab_allocator) {
+    vmap_slab slab;
+    vmap_type* t = init_type();
+    vmap_slab_init(&slab, vmap_initial_bytes(t), 16);
+    free(t);
+    fill_maps(&slab.allocator, 50, 10);
+    fill_maps(&slab.allocator, 50, 10);
+    vmap_slab_free(&slab);
+}
+
+TEST(arena_allocator) {
+    vmap_arena arena;
+    vmap_arena_init(&arena, 1 << 16);
+    fill_maps(&arena.allocator, 20, 30);
+    vmap_arena_reset(&arena);
+    fill_maps(&arena.allocator, 20, 30);
+    vmap_arena_free(&arena);
+}
+
+static void* counting_alloc(void* ctx, size_t size) {
+    *(size_t*)ctx += size;
+    return malloc(size);
+}
+
+static void counting_free(void* ctx, void* ptr, size_t size) {
+    *(size_t*)ctx -= size;
+    free(ptr);
+}
+
+TEST(allocator_var_keys) {
+    size_t live = 0;
+    vmap_allocator allocator = {counting_alloc, counting_free, NULL};
+    vmap_type* t = init_type();
+    vmap* map;
+    char buf[64];
+    size_t i, len = 2000;
+    vmap_key k;
+    allocator.ctx = &live;
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    t->allocator = &allocator;
+    map = vmap_new(t);
+    vassert_ptr_nonnull(map);
+    k.data = buf;
+    for (i = 0; i < len; ++i) {
+        int value = (int)i;
+        k.len = (size_t)snprintf(buf, sizeof buf, "%040lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, &k, &value), VMAP_OK);
+    }
+    /* the long keys live in the arena, which comes from the allocator too */
+    vassert(live > len * 40);
+    for (i = 0; i < len; i += 2) {
+        k.len = (size_t)snprintf(buf, sizeof buf, "%040lu", (unsigned long)i);
+        vassert_int_eq(vmap_erase(&map, &k), VMAP_OK);
+    }
+    vmap_delete(map);
+    /* every block went back with the size it was allocated with */
+    vassert(live == 0);
+}
+
+TEST(batch) {
+    vmap* map = vmap_new(init_type());
+    size_t i, len = 1000;
+    key* keys = calloc(len, sizeof *keys);
+    int* values = calloc(len, sizeof *values);
+    void** key_ptrs = calloc(len, sizeof *key_ptrs);
+    void** value_ptrs = calloc(len, sizeof *value_ptrs);
+    const void** out = calloc(len, sizeof *out);
+    assert(keys && values && key_ptrs && value_ptrs && out);
+    for (i = 0; i < len; ++i) {
+        snprintf(keys[i], sizeof keys[i], "batch%lu", (unsigned long)i);
+        values[i] = i;
+        key_ptrs[i] = keys[i];
+        value_ptrs[i] = &values[i];
+    }
+    vassert_int_eq(vmap_insert_batch(&map, key_ptrs, value_ptrs, len / 2),
+                   VMAP_OK);
+    vassert_uint_eq((unsigned)vmap_find_batch(map, (const void**)key_ptrs,
+                                              len, out),
+                    (unsigned)(len / 2));
+    for (i = 0; i < len; ++i) {
+        if (i < len / 2) {
+            vassert(out[i] != NULL);
+            if (out[i]) {
+                vassert_int_eq(*(const int*)out[i], (int)i);
+            }
+        } else {
+            vassert(out[i] == NULL);
+        }
+    }
+    vmap_delete(map);
+    free(keys);
+    free(values);
+    free(key_ptrs);
+    free(value_ptrs);
+    free(out);
+}
+
+TEST(reserve) {
+    vmap* map = vmap_new(init_type());
+    vmap_type* t = init_type();
+    key first = "first";
+    size_t i, len = 5000;
+    int value = 0;
+    const int* res;
+    vassert_int_eq(vmap_reserve(&map, len), VMAP_OK);
+    vassert_int_eq(vmap_insert(&map, first, &value), VMAP_OK);
+    res = vmap_find(map, first);
+    for (i = 1; i < len; ++i) {
+        key k = {0};
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    /* no resize happened so the entry has not moved */
+    vassert(vmap_find(map, first) == res);
+    vmap_delete(map);
+
+    map = vmap_new_with_capacity(init_type(), len);
+    vassert_ptr_nonnull(map);
+    vassert_int_eq(vmap_insert(&map, first, &value), VMAP_OK);
+    res = vmap_find(map, first);
+    for (i = 1; i < len; ++i) {
+        key k = {0};
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    vassert(vmap_find(map, first) == res);
+    vmap_delete(map);
+
+    t->max_load = 1.5;
+    vassert_ptr_null(vmap_new(t));
+    t->max_load = .5;
+    t->min_load = .6;
+    vassert_ptr_null(vmap_new(t));
+    t->min_load = VMAP_NO_SHRINK;
+    map = vmap_new(t);
+    vassert_ptr_nonnull(map);
+    vmap_delete(map);
+}
+
+TEST(get_or_insert) {
+    size_t pass;
+    for (pass = 0; pass < 2; ++pass) {
+        vmap_type* t = init_type();
+        vmap* map;
+        vmap_statistics st;
+        uint64_t i, len = 1000;
+        int inserted;
+        int* count;
+        t->hash = vmap_hash_key_u64;
+        t->key_size = sizeof(uint64_t);
+        /* the second pass finds keys in the old table of a resize too */
+        t->resize_step = pass ? 4 : 0;
+        map = vmap_new(t);
+        for (i = 0; i < 3 * len; ++i) {
+            uint64_t k = i % len;
+            count = vmap_get_or_insert(&map, &k, &inserted);
+            vassert_ptr_nonnull(count);
+            vassert_int_eq(inserted, i < len);
+            (*count)++;
+        }
+        for (i = 0; i < len; ++i) {
+            count = (int*)vmap_find(map, &i);
+            vassert_ptr_nonnull(count);
+            vassert_int_eq(*count, 3);
+        }
+
+        i = 7;
+        count = vmap_emplace(&map, &i);
+        vassert_ptr_nonnull(count);
+        *count = 42;
+        vassert_int_eq(*(const int*)vmap_find(map, &i), 42);
+        i = len;
+        count = vmap_emplace(&map, &i);
+        vassert_ptr_nonnull(count);
+        *count = 43;
+        vassert_int_eq(*(const int*)vmap_find(map, &i), 43);
+        while (vmap_resize_step(map, (size_t)-1))
+            ;
+        vmap_stats(map, &st);
+        vassert(st.numel == len + 1);
+        vmap_delete(map);
+    }
+}
+
+TEST(insert_hint) {
+    vmap_type* t = init_type();
+    vmap* map;
+    vmap_statistics st;
+    vmap_hint hint, stale;
+    uint64_t i, a = 5000, b = 5001, len = 1000;
+    int value;
+    t->hash = vmap_hash_key_u64;
+    t->key_size = sizeof(uint64_t);
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        value = (int)i;
+        vassert_ptr_null(vmap_find_hint(map, &i, &hint));
+        vassert_int_eq(vmap_insert_hint(&map, &i, &value, &hint), VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        vassert_int_eq(*(const int*)vmap_find(map, &i), (int)i);
+    }
+
+    /* a present key leaves nothing to hint at, the insert replaces it */
+    i = 3;
+    value = -3;
+    vassert_ptr_nonnull(vmap_find_hint(map, &i, &hint));
+    vassert_int_eq(vmap_insert_hint(&map, &i, &value, &hint), VMAP_OK);
+    vassert_int_eq(*(const int*)vmap_find(map, &i), -3);
+
+    /* an erase and an insert in between could have taken the hinted slot */
+    vassert_ptr_null(vmap_find_hint(map, &a, &stale));
+    i = 0;
+    vassert_int_eq(vmap_erase(&map, &i), VMAP_OK);
+    value = (int)b;
+    vassert_int_eq(vmap_insert(&map, &b, &value), VMAP_OK);
+    value = (int)a;
+    vassert_int_eq(vmap_insert_hint(&map, &a, &value, &stale), VMAP_OK);
+    vassert_int_eq(*(const int*)vmap_find(map, &a), (int)a);
+    vassert_int_eq(*(const int*)vmap_find(map, &b), (int)b);
+    vmap_stats(map, &st);
+    vassert(st.numel == len + 1);
+    vmap_delete(map);
+}
+
+size_t hash_calls = 0;
+
+uint64_t counting_hash(const void* k) {
+    hash_calls++;
+    return vmap_hash_key_var(k);
+}
+
+TEST(hashed) {
+    vmap_type* ta = init_type();
+    vmap_type* tb = init_type();
+    vmap *a, *b;
+    uint64_t i, len = 2000;
+    uint64_t hashes[2000];
+    char names[2000][48];
+    vmap_key keys[2000];
+    const void* key_ptrs[2000];
+    const void* out[2000];
+    ta->hash = tb->hash = counting_hash;
+    ta->key_size = tb->key_size = VMAP_VAR_KEYS;
+    a = vmap_new(ta);
+    b = vmap_new(tb);
+    for (i = 0; i < len; ++i) {
+        int value = (int)i;
+        keys[i].len = (size_t)snprintf(names[i], sizeof names[i],
+                                       "tenant-%lu-long-key", (unsigned long)i);
+        keys[i].data = names[i];
+        key_ptrs[i] = &keys[i];
+        hashes[i] = vmap_hash(a, &keys[i]);
+        vassert(hashes[i] == vmap_hash_key_var(&keys[i]));
+        vassert_int_eq(vmap_insert_hashed(&a, &keys[i], &value, hashes[i]),
+                       VMAP_OK);
+        vassert_int_eq(
+            *(int*)vmap_get_or_insert_hashed(&b, &keys[i], hashes[i], NULL),
+            0);
+    }
+#if VMAP_HASH_BITS
+    /* resizes and erases reuse the cached hashes, so besides the keys of
+     * each small table, hashed when it moved to a hashed table, every key
+     * was only hashed once */
+    vassert(hash_calls == len + 2 * VMAP_SMALL_MAX);
+#endif
+    hash_calls = 0;
+    vassert(vmap_find_batch_hashed(a, key_ptrs, hashes, len, out) == len);
+    for (i = 0; i < len; ++i) {
+        vassert_int_eq(*(const int*)out[i], (int)i);
+        vassert_ptr_nonnull(vmap_find_hashed(b, &keys[i], hashes[i]));
+        *(int*)vmap_emplace_hashed(&b, &keys[i], hashes[i]) = -(int)i;
+    }
+    for (i = 0; i < len; i += 2) {
+        vassert_int_eq(vmap_erase_hashed(&a, &keys[i], hashes[i]), VMAP_OK);
+        vassert_int_eq(vmap_erase_hashed(&b, &keys[i], hashes[i]), VMAP_OK);
+    }
+#if VMAP_HASH_BITS
+    vassert(hash_calls == 0);
+#endif
+    for (i = 0; i < len; ++i) {
+        const int* va = vmap_find(a, &keys[i]);
+        const int* vb = vmap_find(b, &keys[i]);
+        if (i % 2 == 0) {
+            vassert_ptr_null(va);
+            vassert_ptr_null(vb);
+        } else {
+            vassert_int_eq(*va, (int)i);
+            vassert_int_eq(*vb, -(int)i);
+        }
+    }
+    vmap_delete(a);
+    vmap_delete(b);
+}
+
+#if VMAP_SMALL_MAX
+TEST(small_map) {
+    vmap_type* t = init_type();
+    vmap* map;
+    vmap_statistics st;
+    vmap_iter it;
+    uint64_t i, n = VMAP_SMALL_MAX, sum = 0, small_bytes;
+    char names[VMAP_SMALL_MAX + 2][16];
+    vmap_key keys[VMAP_SMALL_MAX + 2];
+    const void* batch_keys[VMAP_SMALL_MAX + 2];
+    const void* batch_values[VMAP_SMALL_MAX + 2];
+    t->hash = counting_hash;
+    t->key_size = VMAP_VAR_KEYS;
+    map = vmap_new(t);
+    vassert_ptr_nonnull(map);
+    for (i = 0; i < n + 2; ++i) {
+        keys[i].len = (size_t)snprintf(names[i], sizeof names[i], "attr%lu",
+                                       (unsigned long)i);
+        keys[i].data = names[i];
+        batch_keys[i] = &keys[i];
+    }
+    hash_calls = 0;
+    for (i = 0; i < n; ++i) {
+        int value = (int)i;
+        vassert_int_eq(vmap_insert(&map, &keys[i], &value), VMAP_OK);
+    }
+    /* a small table finds keys by comparing them, never hashing */
+    for (i = 0; i < n; ++i) {
+        vassert_int_eq(*(const int*)vmap_find(map, &keys[i]), (int)i);
+    }
+    vassert_ptr_null(vmap_find(map, &keys[n]));
+    vassert_int_eq(vmap_erase(&map, &keys[0]), VMAP_OK);
+    vassert_int_eq(vmap_erase(&map, &keys[0]), VMAP_NO_KEY);
+    vassert_ptr_null(vmap_find(map, &keys[0]));
+    *(int*)vmap_get_or_insert(&map, &keys[0], NULL) = 0;
+    vassert(vmap_find_batch(map, batch_keys, n + 1, batch_values) == n);
+    vassert_int_eq(*(const int*)batch_values[n - 1], (int)(n - 1));
+    vassert_ptr_null(batch_values[n]);
+    vassert(hash_calls == 0);
+    vmap_foreach(map, it) {
+        sum += *(const int*)it.value;
+    }
+    vassert(sum == n * (n - 1) / 2);
+    vmap_stats(map, &st);
+    vassert(st.numel == n);
+    vassert(st.capacity < 2 * n);
+    vassert(st.max_probe == 0);
+    small_bytes = st.bytes;
+
+    /* one more key moves it to a hashed table, hashing what it held */
+    for (i = n; i < n + 2; ++i) {
+        int value = (int)i;
+        vassert_int_eq(vmap_insert(&map, &keys[i], &value), VMAP_OK);
+    }
+    vassert(hash_calls == n + 2);
+    for (i = 0; i < n + 2; ++i) {
+        vassert_int_eq(*(const int*)vmap_find(map, &keys[i]), (int)i);
+    }
+    vmap_stats(map, &st);
+    vassert(st.numel == n + 2);
+    vassert(st.bytes > small_bytes);
+    vmap_delete(map);
+}
+#endif
+
+TEST(var_keys) {
+    vmap_type* t = init_type();
+    vmap* map;
+    char buf[64];
+    size_t i, len = 3000;
+    vmap_key k;
+    const int* res;
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    map = vmap_new(t);
+    vassert_ptr_nonnull(map);
+    for (i = 0; i < len; ++i) {
+        int value = (int)i;
+        /* short keys stay inline, every third one goes to the arena */
+        k.len = (size_t)snprintf(buf, sizeof buf, i % 3 ? "%lu" : "%lu-%040lu",
+                                 (unsigned long)i, (unsigned long)i);
+        k.data = buf;
+        vassert_int_eq(vmap_insert(&map, &k, &value), VMAP_OK);
+    }
+    for (i = 0; i < len; i += 2) {
+        k.len = (size_t)snprintf(buf, sizeof buf, i % 3 ? "%lu" : "%lu-%040lu",
+                                 (unsigned long)i, (unsigned long)i);
+        k.data = buf;
+        vassert_int_eq(vmap_erase(&map, &k), VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        k.len = (size_t)snprintf(buf, sizeof buf, i % 3 ? "%lu" : "%lu-%040lu",
+                                 (unsigned long)i, (unsigned long)i);
+        k.data = buf;
+        res = vmap_find(map, &k);
+        if (i % 2) {
+            vassert_ptr_nonnull(res);
+            vassert_int_eq(*res, (int)i);
+        } else {
+            vassert_ptr_null(res);
+        }
+        if (i % 3 == 0) {
+            /* a prefix of a stored key is a different key */
+            k.len--;
+            vassert_ptr_null(vmap_find(map, &k));
+        }
+    }
+    vmap_delete(map);
+
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    t->key_free = free;
+    vassert_ptr_null(vmap_new(t));
+    free(t);
+}
+
+static inline uint64_t int_hash(uint32_t k) {
+    return (uint64_t)k * 0x9e3779b97f4a7c15ULL;
+}
+
+#define int_eq(a, b) ((a) == (b))
+
+VMAP_DEFINE(int_map, uint32_t, int, int_hash, int_eq)
+
+TEST(hash) {
+    static const char data[] = "the quick brown fox jumps over the lazy dog, "
+                               "then does it all over again";
+    vmap_type* t = init_type();
+    vmap* map;
+    uint32_t i, len = 1000;
+    size_t n;
+    const int* res;
+    /* every length takes a different path through the bytes hash */
+    for (n = 0; n < sizeof data; ++n) {
+        vassert(vmap_hash_bytes(data, n) == vmap_hash_bytes(data, n));
+        vassert(vmap_hash_bytes_seeded(data, n, 1) !=
+                vmap_hash_bytes_seeded(data, n, 2));
+        vassert(vmap_hash_crc32(data, n) == vmap_hash_crc32(data, n));
+        if (n > 0) {
+            vassert(vmap_hash_bytes(data, n) != vmap_hash_bytes(data, n - 1));
+            vassert(vmap_hash_crc32(data, n) != vmap_hash_crc32(data, n - 1));
+        }
+    }
+    vassert(vmap_hash_u64(1) != vmap_hash_u64(2));
+    vassert(vmap_hash_u64_seeded(1, 1) != vmap_hash_u64_seeded(1, 2));
+
+    t->hash = vmap_hash_key_u32;
+    t->key_size = sizeof(uint32_t);
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        int value = (int)i;
+        vassert_int_eq(vmap_insert(&map, &i, &value), VMAP_OK);
+    }
+    for (i = 0; i < len; ++i) {
+        res = vmap_find(map, &i);
+        vassert_ptr_nonnull(res);
+        vassert_int_eq(*res, (int)i);
+    }
+    vmap_delete(map);
+}
+
+/* checks an iteration over a map holding the keys "key0".."key<len-1>"
+ * with matching values visits each of them once */
+static void check_iter(vmap* map, size_t len) {
+    vmap_iter it;
+    char* seen = calloc(len, 1);
+    size_t n = 0;
+    assert(seen != NULL);
+    vmap_foreach(map, it) {
+        int value = *(const int*)it.value;
+        key k = {0};
+        vassert(value >= 0 && (size_t)value < len);
+        snprintf(k, sizeof k, "key%d", value);
+        vassert(memcmp(it.key, k, sizeof k) == 0);
+        vassert(!seen[value]);
+        seen[value] = 1;
+        n++;
+    }
+    vassert(n == len);
+    free(seen);
+}
+
+TEST(iter) {
+    vmap_type* t = init_type();
+    vmap* map = vmap_new(init_type());
+    vmap_iter it;
+    size_t i, len = 3000, n = 0;
+    char buf[64];
+    vmap_key k;
+    vmap_iter_init(&it, map);
+    vassert(!vmap_iter_next(&it));
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = (int)i;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    check_iter(map, len);
+    vmap_delete(map);
+
+    /* stop in the middle of an incremental resize so both tables are
+     * walked */
+    t->resize_step = 1;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = (int)i;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    vassert(vmap_resize_step(map, 0));
+    check_iter(map, len);
+    vmap_delete(map);
+
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        int value = (int)i;
+        k.len = (size_t)snprintf(buf, sizeof buf, "%0*lu", (int)(i % 40),
+                                 (unsigned long)i);
+        k.data = buf;
+        vassert_int_eq(vmap_insert(&map, &k, &value), VMAP_OK);
+    }
+    vmap_foreach(map, it) {
+        const vmap_key* vk = it.key;
+        int value = *(const int*)it.value;
+        k.len = (size_t)snprintf(buf, sizeof buf, "%0*d", value % 40, value);
+        vassert(vk->len == k.len);
+        vassert(memcmp(vk->data, buf, k.len) == 0);
+        n++;
+    }
+    vassert(n == len);
+    vmap_delete(map);
+}
+
+TEST(snapshot) {
+    const char* path = "vmap_test.snapshot";
+    key missing = "missing";
+    vmap_type* t = init_type();
+    vmap* map;
+    vmap* mapped;
+    vmap_iter it;
+    size_t i, len = 3000, n = 0;
+    char buf[64];
+    vmap_key vk;
+    int value = 0;
+    /* saved in the middle of an incremental resize */
+    t->resize_step = 1;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        int value = (int)i;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    vassert_int_eq(vmap_save(map, path), VMAP_OK);
+    vmap_delete(map);
+    t = init_type();
+    t->value_size = sizeof(short);
+    vassert_ptr_null(vmap_open_mapped(path, t));
+    free(t);
+    mapped = vmap_open_mapped(path, init_type());
+    vassert_ptr_nonnull(mapped);
+    check_iter(mapped, len);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        const int* res;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        res = vmap_find(mapped, k);
+        vassert_ptr_nonnull(res);
+        vassert_int_eq(*res, (int)i);
+        vassert_int_eq(vmap_erase(&mapped, k), VMAP_READ_ONLY);
+    }
+    vassert_ptr_null(vmap_find(mapped, missing));
+    vassert_int_eq(vmap_insert(&mapped, missing, &value), VMAP_READ_ONLY);
+    vmap_delete(mapped);
+
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        value = (int)i;
+        vk.len = (size_t)snprintf(buf, sizeof buf, "%0*lu", (int)(i % 40),
+                                  (unsigned long)i);
+        vk.data = buf;
+        vassert_int_eq(vmap_insert(&map, &vk, &value), VMAP_OK);
+    }
+    vassert_int_eq(vmap_save(map, path), VMAP_OK);
+    vmap_delete(map);
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    mapped = vmap_open_mapped(path, t);
+    vassert_ptr_nonnull(mapped);
+    for (i = 0; i < len; ++i) {
+        const int* res;
+        vk.len = (size_t)snprintf(buf, sizeof buf, "%0*lu", (int)(i % 40),
+                                  (unsigned long)i);
+        vk.data = buf;
+        res = vmap_find(mapped, &vk);
+        vassert_ptr_nonnull(res);
+        vassert_int_eq(*res, (int)i);
+    }
+    vmap_foreach(mapped, it) {
+        n++;
+    }
+    vassert(n == len);
+    vmap_delete(mapped);
+    remove(path);
+}
+
+/* writes len bytes of data to path with the uint64_t at offset, when it is
+ * inside the data, replaced by value, and tries to open the result */
+static unsigned char* read_file(const char* path, size_t* len) {
+    unsigned char* data;
+    FILE* f = fopen(path, "rb");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    *len = (size_t)ftell(f);
+    rewind(f);
+    data = malloc(*len);
+    assert(data != NULL && fread(data, 1, *len, f) == *len);
+    fclose(f);
+    return data;
+}
+
+/* opens a copy of a snapshot with value written at offset, freeing t when
+ * the copy is rejected */
+static vmap* open_patched(const char* path, const unsigned char* data,
+                          size_t len, size_t offset, uint64_t value,
+                          vmap_type* t) {
+    unsigned char* copy = malloc(len);
+    FILE* f = fopen(path, "wb");
+    vmap* map;
+    assert(copy != NULL && f != NULL);
+    memcpy(copy, data, len);
+    if (offset + sizeof value <= len) {
+        memcpy(copy + offset, &value, sizeof value);
+    }
+    assert(fwrite(copy, 1, len, f) == len);
+    fclose(f);
+    free(copy);
+    map = vmap_open_mapped(path, t);
+    if (map == NULL) {
+        free(t);
+    }
+    return map;
+}
+
+TEST(snapshot_corrupt) {
+    const char* path = "vmap_test.snapshot";
+    /* the power in the file header, then the numel and slot_size fields of
+     * the table header that follows it at 128 */
+    static const size_t offsets[] = {40, 40, 40, 128, 128, 168, 168};
+    static const uint64_t values[] = {64,  200, UINT64_MAX, 1 << 20,
+                                      UINT64_MAX, 7, 1 << 20};
+    static const unsigned char long_key[4] = {37, 0, 0, 0};
+    vmap* map = vmap_new(init_type());
+    vmap_type* t;
+    vmap_key k;
+    unsigned char* data;
+    char buf[64];
+    size_t i, len;
+    for (i = 0; i < 100; ++i) {
+        key k = {0};
+        int value = (int)i;
+        snprintf(k, sizeof k, "key%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    vassert_int_eq(vmap_save(map, path), VMAP_OK);
+    vmap_delete(map);
+    data = read_file(path, &len);
+
+    map = open_patched(path, data, len, len, 0, init_type());
+    vassert_ptr_nonnull(map);
+    vmap_delete(map);
+    vassert_ptr_null(open_patched(path, data, len - 1, len, 0, init_type()));
+    for (i = 0; i < arr_size(offsets); ++i) {
+        vassert_ptr_null(
+            open_patched(path, data, len, offsets[i], values[i], init_type()));
+    }
+    free(data);
+
+    /* a long key whose arena offset points past the end of the arena */
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    map = vmap_new(t);
+    k.data = buf;
+    k.len = (size_t)snprintf(buf, sizeof buf, "%037d", 1);
+    vassert_int_eq(vmap_insert(&map, &k, &i), VMAP_OK);
+    vassert_int_eq(vmap_save(map, path), VMAP_OK);
+    vmap_delete(map);
+    data = read_file(path, &len);
+    for (i = 128; i + 12 <= len; ++i) {
+        if (memcmp(data + i, long_key, sizeof long_key) == 0) {
+            break;
+        }
+    }
+    vassert(i + 12 <= len);
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    map = open_patched(path, data, len, i + 4, 0, t);
+    vassert_ptr_nonnull(map);
+    vmap_delete(map);
+    t = init_type();
+    t->hash = vmap_hash_key_var;
+    t->key_size = VMAP_VAR_KEYS;
+    vassert_ptr_null(open_patched(path, data, len, i + 4, 1, t));
+    free(data);
+    remove(path);
+}
+
+/* only live entries reach the file, two maps that end up holding the same
+ * entry after holding different ones save the same bytes */
+TEST(snapshot_zeroed) {
+    const char* path = "vmap_test.snapshot";
+    unsigned char* data[2];
+    size_t i, len[2];
+    int pass;
+    for (pass = 0; pass < 2; ++pass) {
+        vmap* map = vmap_new(init_type());
+        key k = {0};
+        int value = 0;
+        for (i = 0; i < 20; ++i) {
+            snprintf(k, sizeof k, "%c%lu", "ab"[pass], (unsigned long)i);
+            vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+        }
+        for (i = 20; i-- > 0;) {
+            snprintf(k, sizeof k, "%c%lu", "ab"[pass], (unsigned long)i);
+            vassert_int_eq(vmap_erase(&map, k), VMAP_OK);
+        }
+        memset(k, 0, sizeof k);
+        strcpy(k, "x");
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+        vassert_int_eq(vmap_save(map, path), VMAP_OK);
+        vmap_delete(map);
+        data[pass] = read_file(path, &len[pass]);
+    }
+    vassert(len[0] == len[1]);
+#if VMAP_BACKWARD_SHIFT
+    /* tombstones would sit at different slots */
+    vassert(memcmp(data[0], data[1], len[0]) == 0);
+#endif
+    free(data[0]);
+    free(data[1]);
+    remove(path);
+}
+
+/* every 50th key gets a home slot near the end of one of the 16 regions
+ * vmap_build splits a 1 << 18 slot table into with 4 threads, forcing
+ * spills into the next region */
+uint64_t spill_hash(const void* k) {
+    uint64_t x;
+    memcpy(&x, k, sizeof x);
+    if (x % 50 == 0) {
+        return (vmap_hash_u64(x) & ~(uint64_t)0x3fff) | 0x3ffc;
+    }
+    return vmap_hash_u64(x);
+}
+
+/* spill_hash for the decimal var keys of TEST(build) */
+uint64_t spill_var_hash(const void* k) {
+    const vmap_key* var = k;
+    const char* data = var->data;
+    uint64_t x = 0;
+    size_t i;
+    for (i = 0; i < var->len; ++i) {
+        x = x * 10 + (uint64_t)(data[i] - '0');
+    }
+    return spill_hash(&x);
+}
+
+/* a hash that never reads the key data */
+uint64_t len_hash(const void* k) {
+    return ((const vmap_key*)k)->len;
+}
+
+size_t keys_freed;
+
+void count_key_free(void* key) {
+    (void)key;
+    keys_freed++;
+}
+
+TEST(build) {
+    size_t i, n = 100000, threads;
+    uint64_t* data = malloc(n * sizeof *data);
+    int* values = malloc(n * sizeof *values);
+    void** keys = malloc(n * sizeof *keys);
+    void** vals = malloc(n * sizeof *vals);
+    char(*bufs)[64] = malloc(n * sizeof *bufs);
+    vmap_key* var_keys = malloc(n * sizeof *var_keys);
+    assert(data && values && keys && vals && bufs && var_keys);
+    for (i = 0; i < n; ++i) {
+        /* the last 10000 keys repeat earlier ones, the later value wins */
+        data[i] = i % 90000;
+        values[i] = (int)i;
+        keys[i] = &data[i];
+        vals[i] = &values[i];
+    }
+    for (threads = 0; threads <= 4; ++threads) {
+        vmap_type* t = init_type();
+        vmap* map;
+        vmap_iter it;
+        size_t count = 0;
+        t->hash = threads == 4 ? spill_hash : vmap_hash_key_u64;
+        t->key_size = sizeof(uint64_t);
+        map = vmap_build(t, keys, vals, n, threads);
+        vassert_ptr_nonnull(map);
+        for (i = 0; i < 90000; ++i) {
+            uint64_t k = i;
+            const int* res = vmap_find(map, &k);
+            vassert_ptr_nonnull(res);
+            vassert_int_eq(*res, (int)(i < 10000 ? i + 90000 : i));
+        }
+        vmap_foreach(map, it) {
+            count++;
+        }
+        vassert(count == 90000);
+        vmap_delete(map);
+    }
+
+    for (i = 0; i < n; ++i) {
+        var_keys[i].len = (size_t)snprintf(bufs[i], sizeof bufs[i], "%0*lu",
+                                           (int)(i % 40), (unsigned long)i);
+        var_keys[i].data = bufs[i];
+        keys[i] = &var_keys[i];
+    }
+    for (threads = 1; threads <= 4; threads *= 4) {
+        vmap_type* t = init_type();
+        vmap* map;
+        t->hash = vmap_hash_key_var;
+        t->key_size = VMAP_VAR_KEYS;
+        map = vmap_build(t, keys, vals, n, threads);
+        vassert_ptr_nonnull(map);
+        for (i = 0; i < n; ++i) {
+            const int* res = vmap_find(map, keys[i]);
+            vassert_ptr_nonnull(res);
+            vassert_int_eq(*res, (int)i);
+        }
+        vmap_delete(map);
+    }
+
+    /* long keys that spill past their region, some of them repeated */
+    for (i = 0; i < n; ++i) {
+        var_keys[i].len =
+            (size_t)snprintf(bufs[i], sizeof bufs[i], "%0*lu",
+                             (int)(20 + i % 40), (unsigned long)(i % 90000));
+    }
+    for (threads = 1; threads <= 4; threads *= 4) {
+        vmap_type* t = init_type();
+        vmap* map;
+        vmap_statistics st;
+        t->hash = spill_var_hash;
+        t->key_size = VMAP_VAR_KEYS;
+        map = vmap_build(t, keys, vals, n, threads);
+        vassert_ptr_nonnull(map);
+        vmap_stats(map, &st);
+        vassert(st.numel == 90000);
+        for (i = 0; i < n; ++i) {
+            const int* res = vmap_find(map, keys[i]);
+            vassert_ptr_nonnull(res);
+            vassert_int_eq(*res, (int)(i % 90000 < 10000 ? i % 90000 + 90000
+                                                          : i % 90000));
+        }
+        for (i = 0; i < 90000; ++i) {
+            vassert_int_eq(vmap_erase(&map, keys[i]), VMAP_OK);
+        }
+        vmap_stats(map, &st);
+        vassert(st.numel == 0);
+        vmap_delete(map);
+    }
+
+    /* a key too long to store fails the build before any key is freed */
+    if (SIZE_MAX > UINT32_MAX) {
+        vmap_type* t = init_type();
+        t->hash = len_hash;
+        t->key_size = VMAP_VAR_KEYS;
+        t->key_free = count_key_free;
+        var_keys[0].len = 1;
+        var_keys[1].len = 1;
+        var_keys[2].len = (size_t)UINT32_MAX + 1;
+        keys_freed = 0;
+        vassert_ptr_null(vmap_build(t, keys, vals, 3, 1));
+        vassert(keys_freed == 0);
+        free(t);
+    }
+    free(data);
+    free(values);
+    free(keys);
+    free(vals);
+    free(bufs);
+    free(var_keys);
+}
+
+TEST(threaded_resize) {
+    int pass;
+    for (pass = 0; pass < 2; ++pass) {
+        vmap_type* t = init_type();
+        vmap* map;
+        uint64_t i, len = 200000;
+        t->hash = pass ? spill_hash : vmap_hash_key_u64;
+        t->key_size = sizeof(uint64_t);
+        t->value_size = sizeof(uint64_t);
+        t->resize_threads = 4;
+        map = vmap_new(t);
+        for (i = 0; i < len; ++i) {
+            vassert_int_eq(vmap_insert(&map, &i, &i), VMAP_OK);
+        }
+        /* shrinks back down through the same path */
+        for (i = 0; i < len; ++i) {
+            if (i % 8) {
+                vassert_int_eq(vmap_erase(&map, &i), VMAP_OK);
+            }
+        }
+        for (i = 0; i < len; ++i) {
+            const uint64_t* res = vmap_find(map, &i);
+            if (i % 8) {
+                vassert_ptr_null(res);
+            } else {
+                vassert_ptr_nonnull(res);
+                vassert(*res == i);
+            }
+        }
+        vmap_delete(map);
+    }
+}
+
+TEST(stats) {
+    vmap_type* t = init_type();
+    vmap* map;
+    vmap_statistics st;
+    uint64_t i, len = 1000, sum = 0, b;
+    t->hash = vmap_hash_key_u64;
+    t->key_size = sizeof(uint64_t);
+    map = vmap_new(t);
+    for (i = 0; i < len; ++i) {
+        vassert_int_eq(vmap_insert(&map, &i, &i), VMAP_OK);
+    }
+    for (i = 0; i < 2 * len; ++i) {
+        vmap_find(map, &i);
+    }
+    vmap_stats(map, &st);
+    vassert(st.numel == len);
+    vassert(st.numelplusdeleted >= st.numel);
+    vassert(st.capacity == 2048);
+    vassert(st.bytes >= st.capacity * (2 * sizeof(uint64_t) + 1));
+    for (b = 0; b < VMAP_PROBE_BUCKETS; ++b) {
+        sum += st.probe_histogram[b];
+    }
+    vassert(sum == len);
+    vassert(st.max_probe < len);
+#if VMAP_STATS
+    /* 32 slots up to 2048, after moving out of the small table */
+    vassert(st.resizes == 6 + (VMAP_SMALL_MAX > 0));
+    vassert(st.finds == 2 * len);
+    vassert(st.hits == len);
+    vassert(st.misses == len);
+    vassert(st.probes >= st.finds);
+#else
+    vassert(st.finds == 0);
+#endif
+    vmap_delete(map);
+
+    /* every key shares one home slot so the distances run 0, 1, 2, ... */
+    t = init_type();
+    t->hash = collide_hash;
+    map = vmap_new(t);
+    for (i = 0; i < 20; ++i) {
+        key k = {0};
+        int value = (int)i;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_insert(&map, k, &value), VMAP_OK);
+    }
+    vmap_stats(map, &st);
+    vassert(st.max_probe == 19);
+    vassert(st.total_probe == 19 * 20 / 2);
+    for (b = 0; b < VMAP_PROBE_BUCKETS - 1; ++b) {
+        vassert(st.probe_histogram[b] == 1);
+    }
+    vassert(st.probe_histogram[VMAP_PROBE_BUCKETS - 1] == 5);
+    vmap_delete(map);
+}
+
+TEST(define) {
+    int_map* map = int_map_new();
+    uint32_t i, len = 5000;
+    int* res;
+    vassert_ptr_nonnull(map);
+    for (i = 0; i < len; ++i) {
+        vassert_int_eq(int_map_insert(map, i, (int)i), VMAP_OK);
+    }
+    vassert_int_eq(int_map_insert(map, 7, -7), VMAP_OK);
+    vassert(map->numel == len);
+    for (i = 0; i < len; i += 2) {
+        vassert_int_eq(int_map_erase(map, i), VMAP_OK);
+    }
+    vassert_int_eq(int_map_erase(map, 0), VMAP_NO_KEY);
+    for (i = 0; i < len; ++i) {
+        res = int_map_find(map, i);
+        if (i % 2 == 0) {
+            vassert_ptr_null(res);
+        } else {
+            vassert_ptr_nonnull(res);
+            vassert_int_eq(*res, i == 7 ? -7 : (int)i);
+        }
+    }
+    /* shrinks back down as the map empties, each time to a table no fuller
+     * than halfway between the min and max load */
+    for (i = 1; i < len; i += 2) {
+        uint64_t power = map->power;
+        vassert_int_eq(int_map_erase(map, i), VMAP_OK);
+        if (map->power != power) {
+            vassert((double)map->numel <=
+                    (VMAP_MIN_LOAD + VMAP_MAX_LOAD) / 2 *
+                        (double)((uint64_t)1 << map->power));
+        }
+    }
+    vassert(map->numel == 0);
+    vassert(map->power == VMAP_DEFINE_MIN_POWER);
+    int_map_delete(map);
+}
+
+typedef struct {
+    vmap_concurrent* map;
+    size_t len;
+    int done;
+    int failed;
+} concurrent_args;
+
+/* the even keys are never erased so every read section must find them */
+void* concurrent_reader(void* data) {
+    concurrent_args* args = data;
+    vmap_reader* r = vmap_reader_register(args->map);
+    size_t i = 0;
+    assert(r != NULL);
+    while (!__atomic_load_n(&args->done, __ATOMIC_ACQUIRE)) {
+        key k = {0};
+        const int* res;
+        snprintf(k, sizeof k, "%lu", (unsigned long)(i % args->len) & ~1UL);
+        vmap_read_begin(r);
+        res = vmap_concurrent_find(args->map, k);
+        if ((res == NULL) || (*res != (int)((i % args->len) & ~1UL))) {
+            args->failed = 1;
+        }
+        vmap_read_end(r);
+        i++;
+    }
+    vmap_reader_unregister(r);
+    return NULL;
+}
+
+TEST(concurrent) {
+    concurrent_args args = {0};
+    pthread_t thread;
+    size_t i, round, len = 1000;
+    args.map = vmap_concurrent_new(init_type());
+    args.len = len;
+    vassert_ptr_nonnull(args.map);
+    for (i = 0; i < len; i += 2) {
+        key k = {0};
+        int value = i;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_concurrent_insert(args.map, k, &value), VMAP_OK);
+    }
+    pthread_create(&thread, NULL, concurrent_reader, &args);
+    for (round = 0; round < 20; ++round) {
+        for (i = 1; i < len; i += 2) {
+            key k = {0};
+            int value = i;
+            snprintf(k, sizeof k, "%lu", (unsigned long)i);
+            vassert_int_eq(vmap_concurrent_insert(args.map, k, &value),
+                           VMAP_OK);
+        }
+        for (i = 0; i < len; i += 2) {
+            key k = {0};
+            int value = i;
+            snprintf(k, sizeof k, "%lu", (unsigned long)i);
+            vassert_int_eq(vmap_concurrent_insert(args.map, k, &value),
+                           VMAP_OK);
+        }
+        for (i = 1; i < len; i += 2) {
+            key k = {0};
+            snprintf(k, sizeof k, "%lu", (unsigned long)i);
+            vassert_int_eq(vmap_concurrent_erase(args.map, k), VMAP_OK);
+        }
+    }
+    __atomic_store_n(&args.done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    vassert_int_eq(args.failed, 0);
+    for (i = 0; i < len; ++i) {
+        key k = {0};
+        const void* res;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        res = vmap_concurrent_find(args.map, k);
+        vassert((i & 1) ? res == NULL : res != NULL);
+    }
+    vmap_concurrent_delete(args.map);
+}
+
+TEST(concurrent_readers) {
+    vmap_concurrent* map = vmap_concurrent_new(init_type());
+    vmap_reader* readers[VMAP_MAX_READERS];
+    size_t i;
+    vassert_ptr_nonnull(map);
+    for (i = 0; i < VMAP_MAX_READERS; ++i) {
+        readers[i] = vmap_reader_register(map);
+        vassert_ptr_nonnull(readers[i]);
+        /* each reader owns its cache line */
+        vassert((uintptr_t)readers[i] % 64 == 0);
+    }
+    vassert_ptr_null(vmap_reader_register(map));
+    for (i = 0; i < VMAP_MAX_READERS; ++i) {
+        vmap_reader_unregister(readers[i]);
+    }
+    vmap_concurrent_delete(map);
+}
+
+typedef struct {
+    vmap_sharded* map;
+    size_t start;
+    size_t len;
+} sharded_args;
+
+void* sharded_inserter(void* data) {
+    sharded_args* args = data;
+    size_t i;
+    for (i = args->start; i < args->start + args->len; ++i) {
+        key k = {0};
+        int value = i;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_sharded_insert(args->map, k, &value), VMAP_OK);
+    }
+    return NULL;
+}
+
+TEST(sharded) {
+    vmap_sharded* map = vmap_sharded_new(init_type(), 6);
+    sharded_args args[4];
+    pthread_t threads[4];
+    size_t i, len = 1000;
+    vmap_type* t = init_type();
+    vmap_slab slab;
+    vassert_ptr_nonnull(map);
+    /* shared allocators are refused and the type stays with the caller */
+    vmap_slab_init(&slab, vmap_initial_bytes(t), 16);
+    t->allocator = &slab.allocator;
+    vassert_ptr_null(vmap_sharded_new(t, 4));
+    free(t);
+    vmap_slab_free(&slab);
+    for (i = 0; i < 4; ++i) {
+        args[i].map = map;
+        args[i].start = i * len;
+        args[i].len = len;
+        pthread_create(&threads[i], NULL, sharded_inserter, &args[i]);
+    }
+    for (i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < 4 * len; ++i) {
+        key k = {0};
+        int value = -1;
+        snprintf(k, sizeof k, "%lu", (unsigned long)i);
+        vassert_int_eq(vmap_sharded_find(map, k, &value), VMAP_OK);
+        vassert_int_eq(value, (int)i);
+        if (i & 1) {
+            vassert_int_eq(vmap_sharded_erase(map, k), VMAP_OK);
+            vassert_int_eq(vmap_sharded_find(map, k, &value), VMAP_NO_KEY);
+        }
+    }
+    vmap_sharded_delete(map);
+}
+
 int main(void) {
     run_test(it_works);
+    run_test(resize);
+    run_test(collisions);
+    run_test(incremental_resize);
+    run_test(churn);
+    run_test(slab_allocator);
+    run_test(arena_allocator);
+    run_test(allocator_var_keys);
+    run_test(batch);
+    run_test(reserve);
+    run_test(get_or_insert);
+    run_test(insert_hint);
+    run_test(hashed);
+#if VMAP_SMALL_MAX
+    run_test(small_map);
+#endif
+    run_test(var_keys);
+    run_test(var_keys_churn);
+    run_test(define);
+    run_test(hash);
+    run_test(iter);
+    run_test(snapshot);
+    run_test(snapshot_corrupt);
+    run_test(snapshot_zeroed);
+    run_test(build);
+    run_test(threaded_resize);
+    run_test(stats);
+    run_test(concurrent);
+    run_test(concurrent_readers);
+    run_test(sharded);
     tests_done();
     return 0;
 }
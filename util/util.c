@@ -1,35 +1,43 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "util.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define READ_FILE_INITIAL_CAP 32
+#define READ_FILE_CHUNK (1 << 16)
 
 char* read_file(const char* path, size_t* size) {
     char* res;
-    size_t len = 0, cap = READ_FILE_INITIAL_CAP;
+    size_t n, len = 0, cap = READ_FILE_INITIAL_CAP;
     FILE* file;
-    char ch;
     res = malloc(cap);
     if (res == NULL) {
         return NULL;
     }
-    memset(res, 0, cap);
     if (path == NULL) {
         file = stdin;
     } else {
-        file = fopen(path, "r+");
+        file = fopen(path, "r");
     }
     if (file == NULL) {
         free(res);
         return NULL;
     }
 
-    while ((ch = fgetc(file)) != EOF) {
-        if (len == (cap - 1)) {
+    do {
+        if (cap - len < READ_FILE_CHUNK + 1) {
             void* tmp;
-            cap <<= 1;
+            while (cap - len < READ_FILE_CHUNK + 1) {
+                cap <<= 1;
+            }
             tmp = realloc(res, cap);
             if (tmp == NULL) {
                 fclose(file);
@@ -37,16 +45,171 @@ char* read_file(const char* path, size_t* size) {
                 return NULL;
             }
             res = tmp;
-            memset(res + len, 0, cap - len);
         }
-        res[len] = ch;
-        len++;
-    }
+        n = fread(res + len, 1, READ_FILE_CHUNK, file);
+        len += n;
+    } while (n == READ_FILE_CHUNK);
+    res[len] = '\0';
     fclose(file);
     *size = len;
     return res;
 }
 
+int map_file(mapped_file* file, const char* path) {
+    struct stat st;
+    int fd;
+    file->mapped = 0;
+    if (path != NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+            void* data = mmap(NULL, (size_t)st.st_size, PROT_READ,
+                              MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                posix_madvise(data, (size_t)st.st_size,
+                              POSIX_MADV_SEQUENTIAL);
+                file->data = data;
+                file->len = (size_t)st.st_size;
+                file->mapped = 1;
+            }
+        }
+        close(fd);
+        if (file->mapped) {
+            return 0;
+        }
+    }
+    file->data = read_file(path, &file->len);
+    return file->data == NULL ? -1 : 0;
+}
+
+void unmap_file(mapped_file* file) {
+    if (file->mapped) {
+        munmap((void*)file->data, file->len);
+    } else {
+        free((void*)file->data);
+    }
+    file->data = NULL;
+    file->len = 0;
+}
+
+typedef struct {
+    const char* begin;
+    const char* end;
+    size_t record_size;
+    void (*parse)(const char* line, size_t len, void* record);
+    char* records;
+    size_t num_records;
+} parse_chunk;
+
+static void* count_lines(void* data) {
+    parse_chunk* c = data;
+    const char* p = c->begin;
+    while (p < c->end) {
+        const char* nl = memchr(p, '\n', (size_t)(c->end - p));
+        if (nl == NULL) {
+            nl = c->end;
+        }
+        c->num_records += nl != p;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+static void* parse_chunk_lines(void* data) {
+    parse_chunk* c = data;
+    const char* p = c->begin;
+    char* record = c->records;
+    while (p < c->end) {
+        const char* nl = memchr(p, '\n', (size_t)(c->end - p));
+        if (nl == NULL) {
+            nl = c->end;
+        }
+        if (nl != p) {
+            c->parse(p, (size_t)(nl - p), record);
+            record += c->record_size;
+        }
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/* runs fn on every chunk, the first one on the calling thread and the rest
+ * on their own threads or, when one cannot be started, on this one too */
+static void run_chunks(void* (*fn)(void*), parse_chunk* chunks, size_t n) {
+    pthread_t* threads = malloc(n * sizeof *threads);
+    char* started = calloc(n, 1);
+    size_t i;
+    for (i = 1; (threads != NULL) && (started != NULL) && (i < n); ++i) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &chunks[i]) == 0;
+    }
+    fn(&chunks[0]);
+    for (i = 1; i < n; ++i) {
+        if ((started != NULL) && started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            fn(&chunks[i]);
+        }
+    }
+    free(threads);
+    free(started);
+}
+
+void* parse_lines(const char* input, size_t len, size_t nthreads,
+                  size_t record_size,
+                  void (*parse)(const char* line, size_t len, void* record),
+                  size_t* num_records) {
+    parse_chunk* chunks;
+    char* records;
+    size_t i, total = 0;
+    const char* begin = input;
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    chunks = calloc(nthreads, sizeof *chunks);
+    if (chunks == NULL) {
+        return NULL;
+    }
+    /* every chunk but the last ends just past a line break */
+    for (i = 0; i < nthreads; ++i) {
+        const char* end = input + (len * (i + 1) / nthreads);
+        if ((end < input + len) && (end > begin)) {
+            const char* nl =
+                memchr(end - 1, '\n', (size_t)(input + len - (end - 1)));
+            end = nl == NULL ? input + len : nl + 1;
+        }
+        if (end < begin) {
+            end = begin;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        chunks[i].record_size = record_size;
+        chunks[i].parse = parse;
+        begin = end;
+    }
+    chunks[nthreads - 1].end = input + len;
+
+    run_chunks(count_lines, chunks, nthreads);
+    for (i = 0; i < nthreads; ++i) {
+        total += chunks[i].num_records;
+    }
+    records = malloc(total ? total * record_size : 1);
+    if (records == NULL) {
+        free(chunks);
+        return NULL;
+    }
+    for (total = i = 0; i < nthreads; ++i) {
+        chunks[i].records = records + (total * record_size);
+        total += chunks[i].num_records;
+    }
+    run_chunks(parse_chunk_lines, chunks, nthreads);
+
+    free(chunks);
+    *num_records = total;
+    return records;
+}
+
 line_iter line_iter_new(const char* input, size_t len) {
     line_iter iter = {0};
     iter.pos = 0;
@@ -60,19 +223,19 @@ line_iter line_iter_new(const char* input, size_t len) {
 }
 
 size_t num_lines(line_iter* iter) {
-    size_t i, len = iter->len;
+    const char* p = iter->input;
+    const char* end = iter->input + iter->len;
     size_t res = 0;
-    for (i = 0; i < len; ++i) {
-        char at = iter->input[i];
-        if (at == '\n') {
-            res++;
-        }
+    while ((p < end) && ((p = memchr(p, '\n', (size_t)(end - p))) != NULL)) {
+        res++;
+        p++;
     }
     return res;
 }
 
 void line_iter_next(line_iter* iter) {
     size_t old_pos, pos;
+    const char* nl;
     if (iter->pos >= iter->len) {
         iter->cur = iter->next;
         iter->next = NULL;
@@ -86,9 +249,8 @@ void line_iter_next(line_iter* iter) {
     iter->next = (char*)(iter->input) + iter->pos;
     pos = iter->pos;
     old_pos = pos;
-    while (pos < iter->len && iter->input[pos] != '\n') {
-        pos++;
-    }
+    nl = memchr(iter->input + pos, '\n', iter->len - pos);
+    pos = nl == NULL ? iter->len : (size_t)(nl - iter->input);
     iter->pos = pos + 1;
     iter->next_len = pos - old_pos;
 }
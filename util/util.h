@@ -6,6 +6,27 @@
 
 char* read_file(const char* path, size_t* size);
 
+typedef struct {
+    const char* data;
+    size_t len;
+    int mapped;
+} mapped_file;
+
+/* maps the file at path into memory read only. stdin, when path is NULL,
+ * and anything else that cannot be mapped is read into a buffer instead.
+ * returns 0 on success and -1 on failure */
+int map_file(mapped_file* file, const char* path);
+void unmap_file(mapped_file* file);
+
+/* splits input into lines on up to nthreads threads and calls parse on
+ * every non empty one, with the record_size bytes its record goes in. the
+ * records come back in input order and their number is stored to
+ * num_records. returns NULL when out of memory */
+void* parse_lines(const char* input, size_t len, size_t nthreads,
+                  size_t record_size,
+                  void (*parse)(const char* line, size_t len, void* record),
+                  size_t* num_records);
+
 typedef struct {
     size_t pos;
     size_t len;
@@ -4,37 +4,116 @@
 
 #include <float.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/* define BENCH_PERF to also count cycles, instructions, l1d, llc, branch and
+ * dtlb misses with perf_event_open on linux and report their averages per
+ * run of the body. counters the kernel refuses to open are left out of the
+ * report */
+#if defined(BENCH_PERF) && defined(__linux__)
+#define BENCH_USE_PERF 1
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define BENCH_USE_PERF 0
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_USE_TSC 1
+#else
+#define BENCH_USE_TSC 0
+#endif
+
 #define BENCH_VOLATILE_REG(x) asm volatile("" : "+r"(x) : "r"(x) : "memory")
 #define BENCH_VOLATILE_MEM(x) asm volatile("" : "+m"(x) : "m"(x) : "memory")
 
 #define BENCH(title, warmup, samples)                                          \
     for (bench_append(title), bench_internal.i = (warmup) + (samples);         \
-         (bench_internal.ns = bench_gettime()), bench_internal.i--;            \
+         bench_start(), bench_internal.i--;                                    \
          bench_internal.i < (samples)                                          \
          ? bench_update(bench_gettime() - bench_internal.ns),                  \
                               0 : 0)
 
+/* times samples of batch_len runs of the body each, on the cycle counter where
+ * there is one, and records the time per run. this is for bodies too short
+ * for a clock read around every run to be cheap next to them */
+#define BENCH_BATCH(title, warmup, samples, batch_len)                         \
+    for (bench_append_batch(title, batch_len),                                 \
+         bench_internal.i = (warmup) + (samples);                              \
+         bench_start_batch(), bench_internal.i--;                              \
+         bench_internal.i < (samples) ? bench_update_batch(), 0 : 0)           \
+        for (bench_internal.j = 0; bench_internal.j < bench_internal.batch;    \
+             ++bench_internal.j)
+
+/* samples go into a log linear histogram in picoseconds. past the first
+ * 1 << BENCH_HIST_SUB_BITS buckets every power of two is split in half as
+ * many, so percentiles are good to about 1.5% */
+#define BENCH_HIST_SUB_BITS 6
+#define BENCH_HIST_BUCKETS                                                     \
+    ((66 - BENCH_HIST_SUB_BITS) << (BENCH_HIST_SUB_BITS - 1))
+
+#if BENCH_USE_PERF
+#define BENCH_PERF_EVENTS 6
+
+#define BENCH_PERF_CACHE_MISS(cache)                                           \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                            \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char* name;
+    uint32_t type;
+    uint64_t config;
+} bench_perf_events[BENCH_PERF_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"l1d misses", PERF_TYPE_HW_CACHE,
+     BENCH_PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"llc misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"dtlb misses", PERF_TYPE_HW_CACHE,
+     BENCH_PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+#endif /* BENCH_USE_PERF */
+
 typedef struct {
     const char* title;
     size_t count;
     double min;
     double max;
     double mean;
+    /* runs per sample */
+    size_t batch;
+    uint64_t* hist;
+#if BENCH_USE_PERF
+    /* counter totals over all samples */
+    double perf[BENCH_PERF_EVENTS];
+#endif
 } bench_record;
 
 typedef struct {
     size_t len;
     size_t cap;
     size_t i;
+    size_t j;
+    size_t batch;
     double ns;
+    uint64_t ticks;
+    double ticks_per_sec;
+    uint64_t tick_overhead;
     void (*after_bench)(void*);
     void* after_bench_data;
     bench_record* records;
+#if BENCH_USE_PERF
+    int perf_opened;
+    int perf_fds[BENCH_PERF_EVENTS];
+    uint64_t perf_start[BENCH_PERF_EVENTS];
+#endif
 } bench;
 
 static inline double bench_gettime(void) {
@@ -51,8 +130,93 @@ static inline double bench_gettime(void) {
 #endif
 }
 
+static inline uint64_t bench_ticks(void) {
+#if BENCH_USE_TSC
+    _mm_lfence();
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+static inline double bench_monotonic(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_nsec * 1.0 / 1000000000 + t.tv_sec;
+}
+
 static bench bench_internal;
 
+/* measures the tick rate against CLOCK_MONOTONIC over 10ms and the cost of
+ * reading the ticks twice, which every batch has taken off */
+static inline void bench_calibrate(bench* b) {
+    double start = bench_monotonic(), end;
+    uint64_t ticks = bench_ticks(), overhead = UINT64_MAX;
+    size_t i;
+    while ((end = bench_monotonic()) - start < 0.01) {
+    }
+    b->ticks_per_sec = (bench_ticks() - ticks) / (end - start);
+    for (i = 0; i < 1000; ++i) {
+        uint64_t t = bench_ticks();
+        t = bench_ticks() - t;
+        if (t < overhead) {
+            overhead = t;
+        }
+    }
+    b->tick_overhead = overhead;
+}
+
+#if BENCH_USE_PERF
+/* only user space is counted, so the reads around a sample barely show up
+ * in its counts */
+static inline void bench_perf_open(bench* b) {
+    size_t i;
+    int opened = 0;
+    for (i = 0; i < BENCH_PERF_EVENTS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = bench_perf_events[i].type;
+        attr.config = bench_perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        b->perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        opened += b->perf_fds[i] >= 0;
+    }
+    if (opened == 0) {
+        fprintf(stderr, "perf events unavailable, reporting timings only\n");
+    }
+    b->perf_opened = 1;
+}
+
+static inline void bench_perf_read(bench* b, uint64_t* counts) {
+    size_t i;
+    for (i = 0; i < BENCH_PERF_EVENTS; ++i) {
+        if ((b->perf_fds[i] < 0) ||
+            (read(b->perf_fds[i], &counts[i], sizeof counts[i]) !=
+             sizeof counts[i])) {
+            counts[i] = 0;
+        }
+    }
+}
+#endif /* BENCH_USE_PERF */
+
+static inline void bench_start(void) {
+#if BENCH_USE_PERF
+    bench_perf_read(&bench_internal, bench_internal.perf_start);
+#endif
+    bench_internal.ns = bench_gettime();
+}
+
+static inline void bench_start_batch(void) {
+#if BENCH_USE_PERF
+    bench_perf_read(&bench_internal, bench_internal.perf_start);
+#endif
+    bench_internal.ticks = bench_ticks();
+}
+
 static inline void bench_append(char const* title) {
     bench* b = &bench_internal;
     bench_record* r;
@@ -61,11 +225,65 @@ static inline void bench_append(char const* title) {
         b->records =
             (bench_record*)realloc(b->records, b->cap * sizeof *b->records);
     }
+#if BENCH_USE_PERF
+    if (!b->perf_opened) {
+        bench_perf_open(b);
+    }
+#endif
     r = &b->records[b->len++];
-    r->mean = r->count = 0;
+    memset(r, 0, sizeof *r);
     r->min = DBL_MAX;
     r->max = DBL_MIN;
     r->title = title;
+    r->batch = 1;
+    r->hist = (uint64_t*)calloc(BENCH_HIST_BUCKETS, sizeof *r->hist);
+}
+
+static inline void bench_append_batch(char const* title, size_t batch) {
+    bench* b = &bench_internal;
+    if (b->ticks_per_sec == 0) {
+        bench_calibrate(b);
+    }
+    bench_append(title);
+    b->records[b->len - 1].batch = batch;
+    b->batch = batch;
+}
+
+static inline size_t bench_hist_index(uint64_t ps) {
+    int msb, shift;
+    if (ps < ((uint64_t)1 << BENCH_HIST_SUB_BITS)) {
+        return ps;
+    }
+    msb = 63 - __builtin_clzll(ps);
+    shift = msb - BENCH_HIST_SUB_BITS + 1;
+    return ((size_t)shift << (BENCH_HIST_SUB_BITS - 1)) + (ps >> shift);
+}
+
+/* midpoint of the values that land in bucket i */
+static inline double bench_hist_value(size_t i) {
+    size_t half = (size_t)1 << (BENCH_HIST_SUB_BITS - 1);
+    int shift;
+    if (i < 2 * half) {
+        return i;
+    }
+    shift = (int)(i / half) - 1;
+    return ((double)(i - shift * half) + 0.5) * ((uint64_t)1 << shift);
+}
+
+/* smallest time at least a fraction p of the samples took */
+static inline double bench_percentile(const bench_record* r, double p) {
+    uint64_t seen = 0, rank = (uint64_t)(p * r->count + 0.5);
+    size_t i;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < BENCH_HIST_BUCKETS; ++i) {
+        seen += r->hist[i];
+        if (seen >= rank) {
+            return bench_hist_value(i) * 1e-12;
+        }
+    }
+    return r->max;
 }
 
 static inline void set_after_bench(void (*after_bench)(void*), void* data) {
@@ -77,6 +295,14 @@ static inline void set_after_bench(void (*after_bench)(void*), void* data) {
 static inline void bench_update(double time) {
     bench* b = &bench_internal;
     bench_record* r = &bench_internal.records[bench_internal.len - 1];
+#if BENCH_USE_PERF
+    uint64_t counts[BENCH_PERF_EVENTS];
+    size_t i;
+    bench_perf_read(b, counts);
+    for (i = 0; i < BENCH_PERF_EVENTS; ++i) {
+        r->perf[i] += (double)(counts[i] - b->perf_start[i]);
+    }
+#endif
     r->mean += time;
     if (time < r->min) {
         r->min = time;
@@ -85,11 +311,22 @@ static inline void bench_update(double time) {
         r->max = time;
     }
     r->count++;
+    if (r->hist != NULL) {
+        double ps = time > 0 ? time * 1e12 : 0;
+        r->hist[bench_hist_index(ps < 1.8e19 ? (uint64_t)ps : UINT64_MAX)]++;
+    }
     if (b->after_bench) {
         b->after_bench(b->after_bench_data);
     }
 }
 
+static inline void bench_update_batch(void) {
+    bench* b = &bench_internal;
+    uint64_t ticks = bench_ticks() - b->ticks;
+    ticks = ticks > b->tick_overhead ? ticks - b->tick_overhead : 0;
+    bench_update(ticks / b->ticks_per_sec / b->batch);
+}
+
 static inline int bench_record_cmp(void const* lhs, void const* rhs) {
     bench_record const* l = (bench_record const*)lhs;
     bench_record const* r = (bench_record const*)rhs;
@@ -115,13 +352,41 @@ static inline void bench_done(void) {
             putchar(' ');
         }
 
-        printf("mean: %.9e,   min: %.9e,   max: %.9e\n",
+        printf("mean: %.9e,   min: %.9e,   max: %.9e",
                b->records[i].mean / b->records[i].count, b->records[i].min,
                b->records[i].max);
+        if (b->records[i].hist != NULL) {
+            printf(",   p50: %.3e,   p90: %.3e,   p99: %.3e,   p99.9: %.3e",
+                   bench_percentile(&b->records[i], .5),
+                   bench_percentile(&b->records[i], .9),
+                   bench_percentile(&b->records[i], .99),
+                   bench_percentile(&b->records[i], .999));
+        }
+#if BENCH_USE_PERF
+        for (j = 0; j < BENCH_PERF_EVENTS; ++j) {
+            if (b->perf_fds[j] >= 0) {
+                printf(",   %s: %.1f", bench_perf_events[j].name,
+                       b->records[i].perf[j] /
+                           (b->records[i].count * b->records[i].batch));
+            }
+        }
+#endif
+        putchar('\n');
+        free(b->records[i].hist);
     }
     b->len = 0;
 }
 
-static inline void bench_free(void) { free(bench_internal.records); }
+static inline void bench_free(void) {
+#if BENCH_USE_PERF
+    size_t i;
+    for (i = 0; bench_internal.perf_opened && i < BENCH_PERF_EVENTS; ++i) {
+        if (bench_internal.perf_fds[i] >= 0) {
+            close(bench_internal.perf_fds[i]);
+        }
+    }
+#endif
+    free(bench_internal.records);
+}
 
 #endif /* __VBENCH_H__ */
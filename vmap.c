@@ -1,12 +1,61 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include "vmap.h"
+#include "vmap_group.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define VMAP_INITIAL_POWER 5
-#define VMAP_EMPTY (0)
-#define VMAP_DELETED (1 << 0)
-#define VMAP_FULL (1 << 1)
+#define VMAP_MIN_POWER 5
+
+/* tables under VMAP_MIN_POWER are small tables, see VMAP_SMALL_MAX. their
+ * entries sit in the first numel slots and their control bytes are not
+ * mirrored, so group loads past the end only ever see empty bytes */
+#if VMAP_SMALL_MAX > 16
+#error "VMAP_SMALL_MAX must be at most 16"
+#elif VMAP_SMALL_MAX
+#define VMAP_SMALL_POWER                                                       \
+    (VMAP_SMALL_MAX > 8   ? 4                                                  \
+     : VMAP_SMALL_MAX > 4 ? 3                                                  \
+     : VMAP_SMALL_MAX > 2 ? 2                                                  \
+     : VMAP_SMALL_MAX > 1 ? 1                                                  \
+                          : 0)
+#define vmap_is_small(map) ((map)->power < VMAP_MIN_POWER)
+#else
+#define VMAP_SMALL_POWER VMAP_INITIAL_POWER
+#define vmap_is_small(map) 0
+#endif
+
+/* the hash a call needs: none for lookups in a small table, and none for
+ * adding to one until it is full and the next new key moves it to a hashed
+ * table */
+#define vmap_find_hash(map, key)                                               \
+    (vmap_is_small(map) ? 0 : (map)->type->hash((key)))
+#define vmap_add_hash(map, key)                                                \
+    ((vmap_is_small(map) && ((map)->numel < (map)->grow_at))                   \
+         ? 0                                                                   \
+         : (map)->type->hash((key)))
+
+/* highest max_load a map accepts, past it probe runs get too long */
+#define VMAP_LOAD_LIMIT .9375
 
-#define VMAP_MAX_LOAD .7
-#define VMAP_MIN_LOAD .3
+/* number of keys hashed and prefetched ahead of probing by the batch calls */
+#define VMAP_BATCH_SIZE 16
+
+/* vmap_build gives each thread several regions to even out skew, each no
+ * smaller than this many slots */
+#define VMAP_BUILD_PARTS_PER_THREAD 4
+#define VMAP_BUILD_MIN_REGION 4096
+
+#if defined(__GNUC__)
+#define vmap_prefetch(addr) __builtin_prefetch((addr))
+#else
+#define vmap_prefetch(addr) ((void)(addr))
+#endif
 
 #define vmap_key_free(map, key)                                                \
     do {                                                                       \
@@ -23,276 +72,1830 @@
     } while (0)
 
 #define vmap_key_cmp(map, a, b)                                                \
-    (map)->type->key_cmp ? (map)->type->key_cmp((a), (b))                      \
-                         : memcmp((a), (b), (map)->type->key_size)
+    ((map)->type->key_cmp ? (map)->type->key_cmp((a), (b))                     \
+                          : memcmp((a), (b), (map)->type->key_size))
 
-struct vmap_entry {
-    uint8_t flags;
-    unsigned char data[];
-};
+/* how a key of a VMAP_VAR_KEYS map is kept in its slot: short keys inline,
+ * longer ones as an offset into the map's key arena */
+typedef struct {
+    uint32_t len;
+    unsigned char data[VMAP_INLINE_KEY_SIZE];
+} vmap_var_key;
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+    size_t dead;
+} vmap_key_arena;
+
+#if VMAP_STATS
+typedef struct {
+    uint64_t resizes;
+    uint64_t finds;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t probes;
+} vmap_counters;
+
+#define vmap_count(map, counter, n) ((map)->counters->counter += (n))
+#else
+#define vmap_count(map, counter, n) ((void)0)
+#endif
+
+#define vmap_type_key_size(type)                                               \
+    ((type)->key_size == VMAP_VAR_KEYS ? sizeof(vmap_var_key)                  \
+                                       : (type)->key_size)
 
 struct vmap {
     uint64_t numel;
     uint64_t numelplusdeleted;
     uint64_t power;
+    size_t key_size;
     size_t padding;
+    size_t slot_size;
     vmap_type* type;
-    vmap_entry* entries[];
+    vmap_key_arena* keys;
+#if VMAP_STATS
+    /* shared by both tables of an incremental resize */
+    vmap_counters* counters;
+#endif
+    uint64_t min_power;
+    uint64_t grow_at;
+    /* bumped whenever an entry is added or removed and carried over to the
+     * next table, so a vmap_hint can tell it went stale */
+    uint64_t changes;
+    vmap* old;
+    uint64_t migrate_pos;
+    /* size of the whole file mapping for maps from vmap_open_mapped */
+    size_t mapped_size;
+    uint8_t* ctrl;
+    unsigned char slots[];
 };
 
-#define VMAP_HDR_SIZE (uintptr_t)(&((vmap_entry*)NULL)->data)
+/* a vmap_save file is this header, room for the key arena bookkeeping of
+ * the mapped map, then the table exactly as it sits in memory with its
+ * pointers cleared, then the key arena. slots only hold offsets so the image
+ * works wherever it gets mapped */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t hash_bits;
+    uint32_t inline_key_size;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t power;
+    uint64_t table_size;
+    uint64_t keys_len;
+} vmap_snapshot;
+
+#define VMAP_SNAPSHOT_MAGIC "vmapsnap"
+#define VMAP_SNAPSHOT_VERSION 3
+#define VMAP_SNAPSHOT_BYTE_ORDER 0x01020304u
+
+#define vmap_align_up(n, a) (((n) + (a)-1) & ~((size_t)(a)-1))
+#define VMAP_SNAPSHOT_ARENA_OFFSET vmap_align_up(sizeof(vmap_snapshot), 64)
+#define VMAP_SNAPSHOT_TABLE_OFFSET                                             \
+    (VMAP_SNAPSHOT_ARENA_OFFSET + vmap_align_up(sizeof(vmap_key_arena), 64))
+
+#if VMAP_HASH_BITS == 64
+typedef uint64_t vmap_stored_hash;
+#elif VMAP_HASH_BITS == 32
+typedef uint32_t vmap_stored_hash;
+#elif VMAP_HASH_BITS != 0
+#error "VMAP_HASH_BITS must be 64, 32 or 0"
+#endif
+
+#if VMAP_HASH_BITS
+#define VMAP_HDR_SIZE (sizeof(vmap_stored_hash))
+#else
+#define VMAP_HDR_SIZE 0
+#endif
 
 #define vmap_padding(key_size)                                                 \
-    ((sizeof(void*) - ((((key_size)) + VMAP_HDR_SIZE) % sizeof(void*))) &        \
+    ((sizeof(void*) - (((key_size) + VMAP_HDR_SIZE) % sizeof(void*))) &        \
      (sizeof(void*) - 1))
 
+#define vmap_slot_size(key_size, padding, value_size)                          \
+    ((VMAP_HDR_SIZE + (key_size) + (padding) + (value_size) +                  \
+      sizeof(void*) - 1) &                                                     \
+     ~(sizeof(void*) - 1))
+
+#define vmap_slot(map, i) ((map)->slots + ((i) * (map)->slot_size))
+#define vmap_slot_key(slot) ((slot) + VMAP_HDR_SIZE)
+#define vmap_slot_value(map, slot)                                             \
+    ((slot) + VMAP_HDR_SIZE + (map)->key_size + (map)->padding)
+
 static int vmap_resize(vmap** map, uint64_t new_power);
-static vmap* vmap_new_with_cap(vmap_type* type, uint64_t power, size_t padding);
-static vmap_entry* vmap_entry_new(vmap* map, void* key, void* value);
+static vmap* vmap_table_new(vmap_type* type, uint64_t power);
+
+#define vmap_max_load(type)                                                    \
+    ((type)->max_load != 0 ? (type)->max_load : VMAP_MAX_LOAD)
+#define vmap_min_load(type)                                                    \
+    ((type)->min_load != 0 ? (type)->min_load : VMAP_MIN_LOAD)
+
+/* smallest table that holds n entries without crossing max_load */
+static uint64_t vmap_power_for(const vmap_type* type, size_t n) {
+    double max_load = vmap_max_load(type);
+    uint64_t power = VMAP_MIN_POWER;
+    while ((uint64_t)((double)((uint64_t)1 << power) * max_load) < n) {
+        power++;
+    }
+    return power;
+}
+
+/* entries a table of the given power holds before it grows */
+static uint64_t vmap_grow_at(const vmap_type* type, uint64_t power) {
+    if (power < VMAP_MIN_POWER) {
+        return VMAP_SMALL_MAX;
+    }
+    return (uint64_t)((double)((uint64_t)1 << power) * vmap_max_load(type));
+}
+
+static inline uint64_t vmap_shrink_power(vmap* map) {
+    return vmap_shrink_to(map->numel, map->power, map->min_power,
+                          vmap_min_load(map->type), vmap_max_load(map->type));
+}
+
+/* size of the single allocation holding a table: header, slots and control
+ * bytes */
+static inline size_t vmap_table_size(const vmap_type* type, uint64_t power) {
+    size_t cap = ((size_t)1 << power);
+    size_t key_size = vmap_type_key_size(type);
+    size_t slot_size =
+        vmap_slot_size(key_size, vmap_padding(key_size), type->value_size);
+    return (sizeof(vmap)) + (cap * slot_size) + cap + VMAP_GROUP_MAX;
+}
+
+/* everything a map keeps, its tables, key arena and counters, comes from
+ * type->allocator when it has one */
+static inline void* vmap_type_alloc(const vmap_type* type, size_t size) {
+    if (type->allocator) {
+        return type->allocator->alloc(type->allocator->ctx, size);
+    }
+    return vmap_malloc(size);
+}
+
+static inline void vmap_type_free(const vmap_type* type, void* ptr,
+                                  size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (type->allocator) {
+        type->allocator->free(type->allocator->ctx, ptr, size);
+        return;
+    }
+    vmap_free(ptr);
+}
+
+static inline void* vmap_type_calloc(const vmap_type* type, size_t size) {
+    void* ptr = vmap_type_alloc(type, size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+/* moves the first len bytes of a cap byte block to a new new_cap byte one,
+ * the allocator interface has no realloc */
+static void* vmap_type_grow(const vmap_type* type, void* ptr, size_t len,
+                            size_t cap, size_t new_cap) {
+    void* grown;
+    if (type->allocator == NULL) {
+        return vmap_realloc(ptr, new_cap);
+    }
+    grown = vmap_type_alloc(type, new_cap);
+    if (grown == NULL) {
+        return NULL;
+    }
+    if (len) {
+        memcpy(grown, ptr, len);
+    }
+    vmap_type_free(type, ptr, cap);
+    return grown;
+}
+
+static inline void vmap_table_free(vmap* map) {
+    vmap_type_free(map->type, map, vmap_table_size(map->type, map->power));
+}
+
+static inline void vmap_set_ctrl(vmap* map, uint64_t i, uint8_t c) {
+    map->ctrl[i] = c;
+    if ((i < VMAP_GROUP_MAX) && !vmap_is_small(map)) {
+        map->ctrl[((uint64_t)1 << map->power) + i] = c;
+    }
+}
+
+#if VMAP_HASH_BITS
+static inline vmap_stored_hash vmap_slot_hash(const unsigned char* slot) {
+    vmap_stored_hash hash;
+    memcpy(&hash, slot, sizeof hash);
+    return hash;
+}
+
+static inline void vmap_slot_set_hash(unsigned char* slot, uint64_t hash) {
+    vmap_stored_hash h = (vmap_stored_hash)hash;
+    memcpy(slot, &h, sizeof h);
+}
+
+#define vmap_slot_hash_eq(slot, hash)                                          \
+    (vmap_slot_hash(slot) == (vmap_stored_hash)(hash))
+#else
+#define vmap_slot_set_hash(slot, hash) ((void)(slot), (void)(hash))
+#define vmap_slot_hash_eq(slot, hash) 1
+#endif
+
+static inline uint64_t vmap_var_key_offset(const vmap_var_key* k) {
+    uint64_t offset;
+    memcpy(&offset, k->data, sizeof offset);
+    return offset;
+}
+
+static inline vmap_key vmap_var_key_get(vmap* map, const unsigned char* slot) {
+    const vmap_var_key* k = (const vmap_var_key*)vmap_slot_key(slot);
+    vmap_key key;
+    if (k->len <= VMAP_INLINE_KEY_SIZE) {
+        key.data = k->data;
+    } else {
+        key.data = map->keys->data + vmap_var_key_offset(k);
+    }
+    key.len = k->len;
+    return key;
+}
+
+/* copies key into slot, appending it to the key arena when it does not fit
+ * inline */
+static int vmap_slot_set_key(vmap* map, unsigned char* slot, const void* key) {
+    const vmap_key* var;
+    vmap_var_key* k;
+    vmap_key_arena* arena = map->keys;
+    uint64_t offset;
+    if (arena == NULL) {
+        memcpy(vmap_slot_key(slot), key, map->key_size);
+        return VMAP_OK;
+    }
+    var = key;
+    k = (vmap_var_key*)vmap_slot_key(slot);
+    if (var->len > UINT32_MAX) {
+        return VMAP_OOM;
+    }
+    if (var->len <= VMAP_INLINE_KEY_SIZE) {
+        k->len = var->len;
+        memcpy(k->data, var->data, var->len);
+        return VMAP_OK;
+    }
+    if (arena->len + var->len > arena->cap) {
+        size_t cap = arena->cap ? arena->cap : 256;
+        void* tmp;
+        while (arena->len + var->len > cap) {
+            cap <<= 1;
+        }
+        tmp = vmap_type_grow(map->type, arena->data, arena->len, arena->cap,
+                             cap);
+        if (tmp == NULL) {
+            return VMAP_OOM;
+        }
+        arena->data = tmp;
+        arena->cap = cap;
+    }
+    offset = arena->len;
+    memcpy(arena->data + offset, var->data, var->len);
+    arena->len += var->len;
+    k->len = var->len;
+    memcpy(k->data, &offset, sizeof offset);
+    return VMAP_OK;
+}
+
+static inline void vmap_slot_drop_key(vmap* map, unsigned char* slot) {
+    const vmap_var_key* k;
+    if (map->keys == NULL) {
+        vmap_key_free(map, vmap_slot_key(slot));
+        return;
+    }
+    k = (const vmap_var_key*)vmap_slot_key(slot);
+    if (k->len > VMAP_INLINE_KEY_SIZE) {
+        map->keys->dead += k->len;
+    }
+}
+
+static inline int vmap_slot_key_eq(vmap* map, const unsigned char* slot,
+                                   const void* key) {
+    const vmap_key* var;
+    vmap_key k;
+    if (map->keys == NULL) {
+        return vmap_key_cmp(map, vmap_slot_key(slot), key) == 0;
+    }
+    var = key;
+    k = vmap_var_key_get(map, slot);
+    if (map->type->key_cmp) {
+        return map->type->key_cmp(&k, var) == 0;
+    }
+    return (k.len == var->len) && (memcmp(k.data, var->data, k.len) == 0);
+}
+
+/* returns the hash a slot was inserted with, using the cached bits when
+ * they are enough to index a table of the given power. small tables are
+ * filled without hashing so they have nothing cached */
+static inline uint64_t vmap_rehash(vmap* map, const unsigned char* slot,
+                                   uint64_t power) {
+    vmap_key k;
+#if VMAP_HASH_BITS
+    if ((power <= VMAP_HASH_BITS) && !vmap_is_small(map)) {
+        return vmap_slot_hash(slot);
+    }
+#endif
+    (void)power;
+    if (map->keys == NULL) {
+        return map->type->hash(vmap_slot_key(slot));
+    }
+    k = vmap_var_key_get(map, slot);
+    return map->type->hash(&k);
+}
+
+/* rewrites the key arena with only the long keys still in use once more
+ * than half of it belongs to erased keys */
+static void vmap_compact_keys(vmap* map) {
+    vmap_key_arena* arena = map->keys;
+    unsigned char* data;
+    size_t i, len = ((size_t)1 << map->power), used = 0, cap;
+    if ((arena == NULL) || (arena->dead <= arena->len / 2)) {
+        return;
+    }
+    cap = arena->len - arena->dead;
+    data = vmap_type_alloc(map->type, cap);
+    if (data == NULL) {
+        return;
+    }
+    for (i = 0; i < len; i += VMAP_GROUP_WIDTH) {
+        vmap_mask m = vmap_group_match_full(map->ctrl + i);
+        while (m) {
+            unsigned char* slot = vmap_slot(map, i + vmap_mask_index(m));
+            vmap_var_key* k = (vmap_var_key*)vmap_slot_key(slot);
+            if (k->len > VMAP_INLINE_KEY_SIZE) {
+                uint64_t offset = used;
+                memcpy(data + used, arena->data + vmap_var_key_offset(k),
+                       k->len);
+                memcpy(k->data, &offset, sizeof offset);
+                used += k->len;
+            }
+            m = vmap_mask_clear_lowest(m);
+        }
+    }
+    vmap_type_free(map->type, arena->data, arena->cap);
+    arena->data = data;
+    arena->len = used;
+    arena->cap = cap;
+    arena->dead = 0;
+}
+
+/* vmap_compact_keys walks every slot, so erases only start it once the
+ * dead bytes at least match the number of slots. that keeps the arena
+ * within twice its live keys plus one byte per slot */
+static inline void vmap_reclaim_keys(vmap* map) {
+    if (map->keys && (map->keys->dead >= ((size_t)1 << map->power))) {
+        vmap_compact_keys(map);
+    }
+}
+
+/* first 8 bytes of a plain key, or its first 4 when it is shorter */
+static inline uint64_t vmap_key_prefix(const void* key, size_t key_size) {
+    uint64_t p8;
+    uint32_t p4;
+    if (key_size >= sizeof p8) {
+        memcpy(&p8, key, sizeof p8);
+        return p8;
+    }
+    memcpy(&p4, key, sizeof p4);
+    return p4;
+}
+
+/* vmap_find_index for a small table. plain keys of 4 bytes or more are told
+ * apart by their first bytes before calling memcmp, which keys of exactly 4
+ * or 8 bytes do not need at all */
+static uint64_t vmap_small_find_index(vmap* map, const void* key) {
+    size_t key_size = map->key_size;
+    uint64_t i, prefix, len = map->numel;
+    int whole = (key_size == 4) || (key_size == 8);
+    vmap_count(map, probes, 1);
+    if ((map->keys != NULL) || (map->type->key_cmp != NULL) ||
+        (key_size < 4)) {
+        for (i = 0; i < len; ++i) {
+            if (vmap_slot_key_eq(map, vmap_slot(map, i), key)) {
+                return i;
+            }
+        }
+        return (uint64_t)1 << map->power;
+    }
+    prefix = vmap_key_prefix(key, key_size);
+    for (i = 0; i < len; ++i) {
+        const unsigned char* k = vmap_slot_key(vmap_slot(map, i));
+        if ((vmap_key_prefix(k, key_size) == prefix) &&
+            (whole || (memcmp(k, key, key_size) == 0))) {
+            return i;
+        }
+    }
+    return (uint64_t)1 << map->power;
+}
+
+/* returns the index of the slot holding key, or cap if it is not present */
+static inline uint64_t vmap_find_index(vmap* map, const void* key,
+                                       uint64_t hash) {
+    uint64_t mask = ((uint64_t)1 << map->power) - 1;
+    uint64_t pos = vmap_h1(hash) & mask;
+    uint8_t h2 = vmap_h2(hash);
+    if (vmap_is_small(map)) {
+        return vmap_small_find_index(map, key);
+    }
+    while (1) {
+        const uint8_t* g = map->ctrl + pos;
+        vmap_mask m = vmap_group_match(g, h2);
+        vmap_count(map, probes, 1);
+        while (m) {
+            uint64_t i = (pos + vmap_mask_index(m)) & mask;
+            unsigned char* slot = vmap_slot(map, i);
+            if (vmap_slot_hash_eq(slot, hash) &&
+                vmap_slot_key_eq(map, slot, key)) {
+                return i;
+            }
+            m = vmap_mask_clear_lowest(m);
+        }
+        if (vmap_group_match_empty(g)) {
+            return mask + 1;
+        }
+        pos = (pos + VMAP_GROUP_WIDTH) & mask;
+    }
+}
+
+/* returns the first empty or deleted slot on the probe sequence of hash */
+static inline uint64_t vmap_find_non_full(vmap* map, uint64_t hash) {
+    uint64_t mask = ((uint64_t)1 << map->power) - 1;
+    uint64_t pos = vmap_h1(hash) & mask;
+    while (1) {
+        vmap_mask m = vmap_group_match_non_full(map->ctrl + pos);
+        if (m) {
+            return (pos + vmap_mask_index(m)) & mask;
+        }
+        pos = (pos + VMAP_GROUP_WIDTH) & mask;
+    }
+}
+
+/* allocates what a map keeps across resizes, the key arena and counters */
+static int vmap_shared_new(vmap* map) {
+    if (map->type->key_size == VMAP_VAR_KEYS) {
+        map->keys = vmap_type_calloc(map->type, sizeof *map->keys);
+        if (map->keys == NULL) {
+            return VMAP_OOM;
+        }
+    }
+#if VMAP_STATS
+    map->counters = vmap_type_calloc(map->type, sizeof *map->counters);
+    if (map->counters == NULL) {
+        vmap_type_free(map->type, map->keys, sizeof *map->keys);
+        return VMAP_OOM;
+    }
+#endif
+    return VMAP_OK;
+}
+
+static void vmap_shared_free(vmap* map) {
+    if (map->keys) {
+        vmap_type_free(map->type, map->keys->data, map->keys->cap);
+        vmap_type_free(map->type, map->keys, sizeof *map->keys);
+    }
+#if VMAP_STATS
+    vmap_type_free(map->type, map->counters, sizeof *map->counters);
+#endif
+}
 
 vmap* vmap_new(vmap_type* type) {
+    return vmap_new_with_capacity(type, 0);
+}
+
+vmap* vmap_new_with_capacity(vmap_type* type, size_t capacity) {
     vmap* map;
-    size_t initial_cap = (1 << VMAP_INITIAL_POWER);
-    size_t needed = (sizeof *map) + (sizeof(vmap_entry*) * initial_cap);
-    size_t padding;
+    uint64_t power;
     if (type->hash == NULL) {
         return NULL;
     }
-    if (type->key_size == 0) {
+    if ((type->key_size == VMAP_VAR_KEYS) && (type->key_free != NULL)) {
         return NULL;
     }
     if (type->value_size == 0) {
         return NULL;
     }
-    padding = vmap_padding(type->key_size);
-    map = vmap_malloc(needed);
-    memset(map, 0, needed);
-    map->type = type;
-    map->power = VMAP_INITIAL_POWER;
-    map->padding = padding;
+    if ((type->max_load < 0) || (type->max_load > VMAP_LOAD_LIMIT)) {
+        return NULL;
+    }
+    if (vmap_min_load(type) >= vmap_max_load(type)) {
+        return NULL;
+    }
+    power = vmap_power_for(type, capacity);
+    if (capacity <= VMAP_SMALL_MAX) {
+        map = vmap_table_new(type, VMAP_SMALL_POWER);
+    } else {
+        map = vmap_table_new(type, power > VMAP_INITIAL_POWER
+                                       ? power
+                                       : VMAP_INITIAL_POWER);
+    }
+    if (map == NULL) {
+        return NULL;
+    }
+    map->min_power = power;
+    if (vmap_shared_new(map) != VMAP_OK) {
+        vmap_table_free(map);
+        return NULL;
+    }
     return map;
 }
 
-int vmap_insert(vmap** map, void* key, void* value) {
+int vmap_reserve(vmap** map, size_t capacity) {
     vmap* m = *map;
-    uint64_t cap = (1 << m->power);
-    uint64_t hash = m->type->hash(key) & (cap - 1);
-    size_t value_size = m->type->value_size;
-    size_t key_size = m->type->key_size;
-    size_t offset = key_size + m->padding;
-    vmap_entry* new_entry;
-    while (1) {
-        vmap_entry* e = m->entries[hash];
-        double new_load;
-        if (e == NULL) {
-            new_entry = vmap_entry_new(m, key, value);
-            if (new_entry == NULL) {
-                return VMAP_OOM;
-            }
-            m->entries[hash] = new_entry;
-            m->numel++;
-            m->numelplusdeleted++;
-            new_load = (double)m->numelplusdeleted / (double)cap;
-            if (new_load > VMAP_MAX_LOAD) {
-                return vmap_resize(map, m->power + 1);
+    uint64_t power = vmap_power_for(m->type, capacity);
+    if (m->mapped_size) {
+        return VMAP_READ_ONLY;
+    }
+    if (vmap_is_small(m) && (capacity <= m->grow_at)) {
+        return VMAP_OK;
+    }
+    if (power > m->min_power) {
+        m->min_power = power;
+    }
+    if (power > m->power) {
+        return vmap_resize(map, power);
+    }
+    return VMAP_OK;
+}
+
+/* puts key in slot i, a non full slot on the probe sequence of hash or the
+ * slot after the last entry of a small table, growing the table first when
+ * the slot is empty and the table is due to grow. the value is left for the
+ * caller to fill in. returns NULL with *res set on failure */
+static unsigned char* vmap_add_at(vmap** map, uint64_t i, void* key,
+                                  uint64_t hash, int* res) {
+    vmap* m = *map;
+    unsigned char* slot;
+    if (m->ctrl[i] == VMAP_EMPTY) {
+        uint64_t pending = m->old ? m->old->numel : 0;
+        if (m->numelplusdeleted + pending + 1 > m->grow_at) {
+            /* rebuild at the same size when tombstones filled the table */
+            uint64_t new_power =
+                vmap_is_small(m)                  ? m->min_power
+                : (m->numel + 1 > m->grow_at / 2) ? m->power + 1
+                                                  : m->power;
+            *res = vmap_resize(map, new_power);
+            if (*res != VMAP_OK) {
+                return NULL;
             }
-            break;
+            m = *map;
+            i = vmap_find_non_full(m, hash);
         }
-        if (e->flags & VMAP_DELETED) {
-            hash = (hash + 1) & (cap - 1);
-            continue;
-        }
-        if (e->flags & VMAP_FULL) {
-            int cmp = vmap_key_cmp(m, key, value);
-            if (cmp != 0) {
-                hash = (hash + 1) & (cap - 1);
-                continue;
-            }
-            vmap_key_free(m, key);
-            vmap_value_free(m, e->data + offset);
-            memcpy(e->data + offset, value, value_size);
-            break;
-        }
-        // e->flags = VMAP_EMPTY
-        memcpy(e->data, key, key_size);
-        memcpy(e->data + offset, value, value_size);
-        e->flags = VMAP_FULL;
-        m->numel++;
+    }
+    slot = vmap_slot(m, i);
+    if (vmap_slot_set_key(m, slot, key) != VMAP_OK) {
+        *res = VMAP_OOM;
+        return NULL;
+    }
+    if (m->ctrl[i] == VMAP_EMPTY) {
         m->numelplusdeleted++;
-        new_load = (double)m->numelplusdeleted / (double)cap;
-        if (new_load > VMAP_MAX_LOAD) {
-            return vmap_resize(map, m->power + 1);
+    }
+    vmap_slot_set_hash(slot, hash);
+    vmap_set_ctrl(m, i, vmap_h2(hash));
+    m->numel++;
+    m->changes++;
+    return slot;
+}
+
+/* returns the slot holding key, adding key with its value unset when it is
+ * missing, and sets *found to which of the two happened. the slot may be in
+ * the old table of an incremental resize. returns NULL with *res set on
+ * failure */
+static unsigned char* vmap_find_or_add(vmap** map, void* key, uint64_t hash,
+                                       int* found, int* res) {
+    vmap* m = *map;
+    uint64_t cap = ((uint64_t)1 << m->power);
+    uint64_t i;
+    if (m->mapped_size) {
+        *res = VMAP_READ_ONLY;
+        return NULL;
+    }
+    if (m->old) {
+        vmap_resize_step(m, m->type->resize_step);
+    }
+    *found = 1;
+    i = vmap_find_index(m, key, hash);
+    if (i != cap) {
+        return vmap_slot(m, i);
+    }
+    if (m->old) {
+        vmap* old = m->old;
+        i = vmap_find_index(old, key, hash);
+        if (i != ((uint64_t)1 << old->power)) {
+            return vmap_slot(old, i);
         }
-        break;
     }
+    *found = 0;
+    i = vmap_is_small(m) ? m->numel : vmap_find_non_full(m, hash);
+    return vmap_add_at(map, i, key, hash, res);
+}
+
+uint64_t vmap_hash(const vmap* map, const void* key) {
+    return map->type->hash(key);
+}
+
+int vmap_insert_hashed(vmap** map, void* key, void* value, uint64_t hash) {
+    int found, res = VMAP_OK;
+    unsigned char* slot = vmap_find_or_add(map, key, hash, &found, &res);
+    vmap* m = *map;
+    if (slot == NULL) {
+        return res;
+    }
+    if (found) {
+        vmap_key_free(m, key);
+        vmap_value_free(m, vmap_slot_value(m, slot));
+    }
+    memcpy(vmap_slot_value(m, slot), value, m->type->value_size);
     return VMAP_OK;
 }
 
+int vmap_insert(vmap** map, void* key, void* value) {
+    return vmap_insert_hashed(map, key, value, vmap_add_hash(*map, key));
+}
+
+void* vmap_get_or_insert(vmap** map, void* key, int* inserted) {
+    return vmap_get_or_insert_hashed(map, key, vmap_add_hash(*map, key),
+                                     inserted);
+}
+
+void* vmap_get_or_insert_hashed(vmap** map, void* key, uint64_t hash,
+                                int* inserted) {
+    int found, res = VMAP_OK;
+    unsigned char* slot = vmap_find_or_add(map, key, hash, &found, &res);
+    unsigned char* value;
+    if (slot == NULL) {
+        return NULL;
+    }
+    value = vmap_slot_value(*map, slot);
+    if (found) {
+        vmap_key_free(*map, key);
+    } else {
+        memset(value, 0, (*map)->type->value_size);
+    }
+    if (inserted) {
+        *inserted = !found;
+    }
+    return value;
+}
+
+void* vmap_emplace(vmap** map, void* key) {
+    return vmap_emplace_hashed(map, key, vmap_add_hash(*map, key));
+}
+
+void* vmap_emplace_hashed(vmap** map, void* key, uint64_t hash) {
+    int found, res = VMAP_OK;
+    unsigned char* slot = vmap_find_or_add(map, key, hash, &found, &res);
+    unsigned char* value;
+    if (slot == NULL) {
+        return NULL;
+    }
+    value = vmap_slot_value(*map, slot);
+    if (found) {
+        vmap_key_free(*map, key);
+        vmap_value_free(*map, value);
+    }
+    return value;
+}
+
+const void* vmap_find_hashed(vmap* map, const void* key, uint64_t hash) {
+    uint64_t cap = ((uint64_t)1 << map->power);
+    uint64_t i;
+    vmap_count(map, finds, 1);
+    if (map->old) {
+        vmap_resize_step(map, map->type->resize_step);
+    }
+    i = vmap_find_index(map, key, hash);
+    if (i != cap) {
+        vmap_count(map, hits, 1);
+        return vmap_slot_value(map, vmap_slot(map, i));
+    }
+    if (map->old) {
+        vmap* old = map->old;
+        i = vmap_find_index(old, key, hash);
+        if (i != ((uint64_t)1 << old->power)) {
+            vmap_count(map, hits, 1);
+            return vmap_slot_value(old, vmap_slot(old, i));
+        }
+    }
+    vmap_count(map, misses, 1);
+    return NULL;
+}
+
 const void* vmap_find(vmap* map, const void* key) {
-    uint64_t cap = (1 << map->power);
-    uint64_t hash = map->type->hash(key) & (cap - 1);
-    size_t key_size = map->type->key_size;
-    size_t offset = key_size + map->padding;
-    while (1) {
-        vmap_entry* e = map->entries[hash];
-        int cmp;
-        if (e == NULL) {
-            break;
+    return vmap_find_hashed(map, key, vmap_find_hash(map, key));
+}
+
+const void* vmap_find_hint(vmap* map, const void* key, vmap_hint* hint) {
+    return vmap_find_hint_hashed(map, key, map->type->hash(key), hint);
+}
+
+const void* vmap_find_hint_hashed(vmap* map, const void* key, uint64_t hash,
+                                  vmap_hint* hint) {
+    const void* value = vmap_find_hashed(map, key, hash);
+    hint->hash = hash;
+    hint->table = NULL;
+    if ((value == NULL) && (map->old == NULL) && (map->mapped_size == 0)) {
+        hint->table = map;
+        hint->changes = map->changes;
+        hint->pos = vmap_is_small(map) ? map->numel
+                                       : vmap_find_non_full(map, hash);
+    }
+    return value;
+}
+
+int vmap_insert_hint(vmap** map, void* key, void* value,
+                     const vmap_hint* hint) {
+    vmap* m = *map;
+    unsigned char* slot;
+    int res = VMAP_OK;
+    if ((hint->table != m) || (hint->changes != m->changes) || m->old) {
+        return vmap_insert_hashed(map, key, value, hint->hash);
+    }
+    slot = vmap_add_at(map, hint->pos, key, hint->hash, &res);
+    if (slot == NULL) {
+        return res;
+    }
+    memcpy(vmap_slot_value(*map, slot), value, (*map)->type->value_size);
+    return VMAP_OK;
+}
+
+/* prefetches the home groups and slots of a chunk of hashes before any of
+ * them is probed so the cache misses overlap */
+static inline void vmap_prefetch_homes(vmap* map, const uint64_t* hashes,
+                                       size_t n) {
+    uint64_t mask = ((uint64_t)1 << map->power) - 1;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        uint64_t pos = vmap_h1(hashes[i]) & mask;
+        vmap_prefetch(map->ctrl + pos);
+        vmap_prefetch(vmap_slot(map, pos));
+    }
+}
+
+static inline void vmap_hash_chunk(vmap* map, const void** keys, size_t n,
+                                   uint64_t* hashes) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        hashes[i] = map->type->hash(keys[i]);
+    }
+}
+
+/* small tables are scanned without hashing, as by vmap_find and
+ * vmap_insert, and have no slots worth prefetching */
+size_t vmap_find_batch(vmap* map, const void** keys, size_t n,
+                       const void** out_values) {
+    uint64_t hashes[VMAP_BATCH_SIZE];
+    size_t i, found = 0;
+    if (vmap_is_small(map)) {
+        for (i = 0; i < n; ++i) {
+            out_values[i] = vmap_find(map, keys[i]);
+            found += out_values[i] != NULL;
         }
-        if (e->flags == VMAP_EMPTY) {
-            break;
+        return found;
+    }
+    for (i = 0; i < n; i += VMAP_BATCH_SIZE) {
+        size_t len = n - i < VMAP_BATCH_SIZE ? n - i : VMAP_BATCH_SIZE;
+        vmap_hash_chunk(map, keys + i, len, hashes);
+        found +=
+            vmap_find_batch_hashed(map, keys + i, hashes, len, out_values + i);
+    }
+    return found;
+}
+
+size_t vmap_find_batch_hashed(vmap* map, const void** keys,
+                              const uint64_t* hashes, size_t n,
+                              const void** out_values) {
+    size_t i, j, found = 0;
+    for (i = 0; i < n; i += VMAP_BATCH_SIZE) {
+        size_t len = n - i < VMAP_BATCH_SIZE ? n - i : VMAP_BATCH_SIZE;
+        vmap_prefetch_homes(map, hashes + i, len);
+        for (j = i; j < i + len; ++j) {
+            out_values[j] = vmap_find_hashed(map, keys[j], hashes[j]);
+            found += out_values[j] != NULL;
         }
-        if (e->flags & VMAP_DELETED) {
-            hash = (hash + 1) & (cap - 1);
-            continue;
+    }
+    return found;
+}
+
+int vmap_insert_batch(vmap** map, void** keys, void** values, size_t n) {
+    uint64_t hashes[VMAP_BATCH_SIZE];
+    size_t i, len;
+    for (i = 0; i < n; i += len) {
+        int res;
+        len = n - i < VMAP_BATCH_SIZE ? n - i : VMAP_BATCH_SIZE;
+        if (vmap_is_small(*map)) {
+            /* one key at a time, the table may turn hashed part way */
+            len = 1;
+            res = vmap_insert(map, keys[i], values[i]);
+        } else {
+            vmap_hash_chunk(*map, (const void**)(keys + i), len, hashes);
+            res = vmap_insert_batch_hashed(map, keys + i, values + i, hashes,
+                                           len);
+        }
+        if (res != VMAP_OK) {
+            return res;
+        }
+    }
+    return VMAP_OK;
+}
+
+int vmap_insert_batch_hashed(vmap** map, void** keys, void** values,
+                             const uint64_t* hashes, size_t n) {
+    size_t i, j;
+    for (i = 0; i < n; i += VMAP_BATCH_SIZE) {
+        size_t len = n - i < VMAP_BATCH_SIZE ? n - i : VMAP_BATCH_SIZE;
+        vmap_prefetch_homes(*map, hashes + i, len);
+        for (j = i; j < i + len; ++j) {
+            int res = vmap_insert_hashed(map, keys[j], values[j], hashes[j]);
+            if (res != VMAP_OK) {
+                return res;
+            }
+        }
+    }
+    return VMAP_OK;
+}
+
+/* vmap_build and the threaded vmap_resize fill a table the same way. items
+ * are either keys[i] and values[i], or when src is set the full slots of
+ * the table being resized, which are moved without comparing keys */
+typedef struct {
+    vmap* map;
+    vmap* src;
+    void** keys;
+    void** values;
+    uint64_t* hashes;
+    size_t* order;
+    /* per thread and region item counts, turned into scatter cursors */
+    size_t* counts;
+    /* per thread and region bytes of keys that go to the key arena */
+    size_t* long_bytes;
+    /* first slot of each region's items in order, its arena reservation and
+     * the number of its items that did not fit in the region */
+    size_t* part_start;
+    size_t* part_arena;
+    size_t* part_spills;
+    size_t n;
+    size_t nthreads;
+    size_t parts;
+    uint64_t shift;
+} vmap_build_ctx;
+
+typedef struct {
+    vmap_build_ctx* ctx;
+    size_t id;
+    size_t numel;
+    size_t arena_dead;
+    /* set when a key is longer than a var keys map can store */
+    int too_long;
+} vmap_build_worker;
+
+#define vmap_build_part(ctx, hash)                                             \
+    ((vmap_h1(hash) & (((uint64_t)1 << (ctx)->map->power) - 1)) >>           \
+     (ctx)->shift)
+
+/* whether item i exists, only slots of src can be empty */
+#define vmap_build_item(ctx, i)                                                \
+    ((ctx)->src == NULL || vmap_ctrl_is_full((ctx)->src->ctrl[(i)]))
+
+static inline uint64_t vmap_build_hash_of(vmap_build_ctx* ctx, size_t i) {
+    if (ctx->src) {
+        return vmap_rehash(ctx->src, vmap_slot(ctx->src, i), ctx->map->power);
+    }
+    return ctx->hashes[i];
+}
+
+/* runs fn once per worker, worker 0 on the calling thread. a worker whose
+ * thread cannot be started runs on the calling thread too */
+static void vmap_run_workers(void* (*fn)(void*), vmap_build_worker* workers,
+                             size_t nthreads) {
+    pthread_t* threads = vmap_malloc(nthreads * sizeof *threads);
+    char* started = vmap_calloc(nthreads, 1);
+    size_t t;
+    for (t = 1; (threads != NULL) && (started != NULL) && (t < nthreads);
+         ++t) {
+        started[t] = pthread_create(&threads[t], NULL, fn, &workers[t]) == 0;
+    }
+    fn(&workers[0]);
+    for (t = 1; t < nthreads; ++t) {
+        if ((started != NULL) && started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            fn(&workers[t]);
         }
-        // e->flags = VMAP_FULL
-        cmp = vmap_key_cmp(map, e->data, key);
-        if (cmp != 0) {
-            hash = (hash + 1) & (cap - 1);
+    }
+    vmap_free(threads);
+    vmap_free(started);
+}
+
+static void* vmap_build_hash(void* data) {
+    vmap_build_worker* w = data;
+    vmap_build_ctx* ctx = w->ctx;
+    size_t i, end = ctx->n * (w->id + 1) / ctx->nthreads;
+    size_t* counts = ctx->counts + (w->id * ctx->parts);
+    size_t* long_bytes = ctx->long_bytes + (w->id * ctx->parts);
+    for (i = ctx->n * w->id / ctx->nthreads; i < end; ++i) {
+        uint64_t hash;
+        size_t part;
+        if (!vmap_build_item(ctx, i)) {
             continue;
         }
-        return e->data + offset;
+        if (ctx->src) {
+            hash = vmap_build_hash_of(ctx, i);
+        } else {
+            hash = ctx->map->type->hash(ctx->keys[i]);
+            ctx->hashes[i] = hash;
+        }
+        part = vmap_build_part(ctx, hash);
+        counts[part]++;
+        if (ctx->map->keys && (ctx->src == NULL)) {
+            const vmap_key* k = ctx->keys[i];
+            if (k->len > UINT32_MAX) {
+                w->too_long = 1;
+            } else if (k->len > VMAP_INLINE_KEY_SIZE) {
+                long_bytes[part] += k->len;
+            }
+        }
     }
     return NULL;
 }
 
-int vmap_erase(vmap** map, const void* key) {
-    vmap* m = *map;
-    uint64_t cap = (1 << m->power);
-    uint64_t hash = m->type->hash(key) & (cap - 1);
-    size_t key_size = m->type->key_size;
-    size_t offset = key_size + m->padding;
-
-    while (1) {
-        vmap_entry* e = m->entries[hash];
-        int cmp;
-        double new_load;
-        if (e == NULL) {
-            break;
+/* the scatter is stable so each region sees its items in input order */
+static void* vmap_build_scatter(void* data) {
+    vmap_build_worker* w = data;
+    vmap_build_ctx* ctx = w->ctx;
+    size_t i, end = ctx->n * (w->id + 1) / ctx->nthreads;
+    size_t* cursors = ctx->counts + (w->id * ctx->parts);
+    for (i = ctx->n * w->id / ctx->nthreads; i < end; ++i) {
+        if (vmap_build_item(ctx, i)) {
+            size_t part = vmap_build_part(ctx, vmap_build_hash_of(ctx, i));
+            ctx->order[cursors[part]++] = i;
         }
-        if (e->flags == VMAP_EMPTY) {
-            break;
+    }
+    return NULL;
+}
+
+/* copies the key of keys[idx] into a free slot, long keys of a var keys map
+ * go to the arena space reserved for the region */
+static void vmap_build_set_key(vmap* map, unsigned char* slot, const void* key,
+                               size_t* arena_pos) {
+    const vmap_key* var = key;
+    vmap_var_key* vk = (vmap_var_key*)vmap_slot_key(slot);
+    uint64_t offset = *arena_pos;
+    if (map->keys == NULL) {
+        memcpy(vmap_slot_key(slot), key, map->key_size);
+        return;
+    }
+    vk->len = (uint32_t)var->len;
+    if (var->len <= VMAP_INLINE_KEY_SIZE) {
+        memcpy(vk->data, var->data, var->len);
+        return;
+    }
+    memcpy(map->keys->data + offset, var->data, var->len);
+    memcpy(vk->data, &offset, sizeof offset);
+    *arena_pos += var->len;
+}
+
+/* places the items of one region without probing past its last slot. an
+ * item whose probe run reaches the end is left for the serial pass, and so
+ * is every later key with the same hash, so duplicates keep their order */
+static void vmap_build_region(vmap_build_worker* w, size_t part) {
+    vmap_build_ctx* ctx = w->ctx;
+    vmap* map = ctx->map;
+    size_t region = (size_t)1 << ctx->shift;
+    size_t lo = part * region, hi = lo + region;
+    size_t k, start = ctx->part_start[part], end = ctx->part_start[part + 1];
+    size_t arena_pos = ctx->part_arena[part];
+    size_t arena_end = ctx->part_arena[part + 1];
+    size_t spills = 0;
+    for (k = start; k < end; ++k) {
+        size_t idx = ctx->order[k];
+        uint64_t hash = vmap_build_hash_of(ctx, idx);
+        uint8_t h2 = vmap_h2(hash);
+        size_t i = vmap_h1(hash) & (((uint64_t)1 << map->power) - 1);
+        unsigned char* slot;
+        for (; i < hi; ++i) {
+            if (map->ctrl[i] == VMAP_EMPTY) {
+                break;
+            }
+            slot = vmap_slot(map, i);
+            if ((ctx->src == NULL) && (map->ctrl[i] == h2) &&
+                vmap_slot_hash_eq(slot, hash) &&
+                vmap_slot_key_eq(map, slot, ctx->keys[idx])) {
+                break;
+            }
         }
-        if (e->flags & VMAP_DELETED) {
-            hash = (hash + 1) & (cap - 1);
+        if (i == hi) {
+            ctx->order[start + spills++] = idx;
             continue;
         }
-        // e->flags = VMAP_FULL
-        cmp = vmap_key_cmp(m, e->data, key);
-        if (cmp != 0) {
-            hash = (hash + 1) & (cap - 1);
-            continue;
+        slot = vmap_slot(map, i);
+        if (ctx->src) {
+            memcpy(slot, vmap_slot(ctx->src, idx), map->slot_size);
+        } else if (map->ctrl[i] != VMAP_EMPTY) {
+            vmap_key_free(map, ctx->keys[idx]);
+            vmap_value_free(map, vmap_slot_value(map, slot));
+        } else {
+            vmap_build_set_key(map, slot, ctx->keys[idx], &arena_pos);
+            vmap_slot_set_hash(slot, hash);
         }
-        vmap_value_free(m, e->data + offset);
-        vmap_key_free(m, e->data);
-        e->flags = VMAP_DELETED;
-        m->numel--;
-        new_load = (double)m->numel / (double)cap;
-        if ((new_load < VMAP_MIN_LOAD) && (m->power > 2)) {
-            return vmap_resize(map, m->power - 1);
+        if (ctx->src == NULL) {
+            memcpy(vmap_slot_value(map, slot), ctx->values[idx],
+                   map->type->value_size);
         }
+        if (map->ctrl[i] == VMAP_EMPTY) {
+            vmap_set_ctrl(map, i, h2);
+            w->numel++;
+        }
+    }
+    ctx->part_spills[part] = spills;
+    w->arena_dead += arena_end - arena_pos;
+}
+
+static void* vmap_build_fill(void* data) {
+    vmap_build_worker* w = data;
+    size_t part;
+    for (part = w->id; part < w->ctx->parts; part += w->ctx->nthreads) {
+        vmap_build_region(w, part);
+    }
+    return NULL;
+}
+
+/* prefix sums of the per thread counts: scatter cursors for each thread
+ * and the start of each region's items and arena reservation. returns the
+ * number of bytes of the key arena to reserve */
+static size_t vmap_build_offsets(vmap_build_ctx* ctx) {
+    size_t t, part, keys = 0, bytes = ctx->map->keys ? ctx->map->keys->len : 0;
+    for (part = 0; part < ctx->parts; ++part) {
+        ctx->part_start[part] = keys;
+        ctx->part_arena[part] = bytes;
+        for (t = 0; t < ctx->nthreads; ++t) {
+            size_t count = ctx->counts[(t * ctx->parts) + part];
+            ctx->counts[(t * ctx->parts) + part] = keys;
+            keys += count;
+            bytes += ctx->long_bytes[(t * ctx->parts) + part];
+        }
+    }
+    ctx->part_start[ctx->parts] = keys;
+    ctx->part_arena[ctx->parts] = bytes;
+    return bytes - ctx->part_arena[0];
+}
+
+static int vmap_reserve_keys(vmap* map, size_t len) {
+    vmap_key_arena* arena = map->keys;
+    void* tmp;
+    if (arena->len + len <= arena->cap) {
         return VMAP_OK;
     }
+    tmp = vmap_type_grow(map->type, arena->data, arena->len, arena->cap,
+                         arena->len + len);
+    if (tmp == NULL) {
+        return VMAP_OOM;
+    }
+    arena->data = tmp;
+    arena->cap = arena->len + len;
+    return VMAP_OK;
+}
 
-    return VMAP_NO_KEY;
+/* inserts the items a region could not hold, in region order. moved slots
+ * cannot collide so they only need a free slot. long keys go to the end of
+ * their region's arena reservation, which the region left unused for them,
+ * so nothing here allocates and no key is freed before the build can no
+ * longer fail */
+static void vmap_build_spills(vmap_build_ctx* ctx) {
+    vmap* map = ctx->map;
+    size_t part, k;
+    for (part = 0; part < ctx->parts; ++part) {
+        size_t start = ctx->part_start[part];
+        size_t end = start + ctx->part_spills[part];
+        size_t arena_pos = ctx->part_arena[part + 1];
+        for (k = start; map->keys && (ctx->src == NULL) && (k < end); ++k) {
+            const vmap_key* var = ctx->keys[ctx->order[k]];
+            if (var->len > VMAP_INLINE_KEY_SIZE) {
+                arena_pos -= var->len;
+            }
+        }
+        for (k = start; k < end; ++k) {
+            size_t idx = ctx->order[k];
+            uint64_t hash = vmap_build_hash_of(ctx, idx);
+            uint64_t i;
+            unsigned char* slot;
+            if (ctx->src) {
+                i = vmap_find_non_full(map, hash);
+                memcpy(vmap_slot(map, i), vmap_slot(ctx->src, idx),
+                       map->slot_size);
+                vmap_set_ctrl(map, i, vmap_h2(hash));
+                continue;
+            }
+            i = vmap_find_index(map, ctx->keys[idx], hash);
+            if ((i >> map->power) == 0) {
+                slot = vmap_slot(map, i);
+                vmap_key_free(map, ctx->keys[idx]);
+                vmap_value_free(map, vmap_slot_value(map, slot));
+            } else {
+                size_t used = arena_pos;
+                i = vmap_find_non_full(map, hash);
+                slot = vmap_slot(map, i);
+                vmap_build_set_key(map, slot, ctx->keys[idx], &arena_pos);
+                vmap_slot_set_hash(slot, hash);
+                vmap_set_ctrl(map, i, vmap_h2(hash));
+                map->numel++;
+                map->numelplusdeleted++;
+                if (map->keys) {
+                    map->keys->dead -= arena_pos - used;
+                }
+            }
+            memcpy(vmap_slot_value(map, slot), ctx->values[idx],
+                   map->type->value_size);
+        }
+    }
 }
 
-void vmap_delete(vmap* map) {
-    size_t i, len = (1 << map->power);
-    size_t key_size = map->type->key_size;
-    size_t offset = key_size + map->padding;
-    for (i = 0; i < len; ++i) {
-        vmap_entry* e = map->entries[i];
-        if (e == NULL) {
-            continue;
+/* fills ctx->map from ctx->n items on up to nthreads threads. the table is
+ * split into power of two regions by the top bits of the home slot */
+static int vmap_build_run(vmap_build_ctx* ctx, size_t nthreads) {
+    vmap_build_worker* workers;
+    size_t t, region, num_items = ctx->src ? ctx->src->numel : ctx->n;
+    size_t arena_len = 0;
+    int res = VMAP_OK;
+    ctx->nthreads = nthreads ? nthreads : 1;
+    ctx->parts = 1;
+    while ((ctx->parts < ctx->nthreads * VMAP_BUILD_PARTS_PER_THREAD) &&
+           ((((size_t)1 << ctx->map->power) / (ctx->parts << 1)) >=
+            VMAP_BUILD_MIN_REGION)) {
+        ctx->parts <<= 1;
+    }
+    ctx->shift = ctx->map->power;
+    for (region = ctx->parts; region > 1; region >>= 1) {
+        ctx->shift--;
+    }
+    if (ctx->nthreads > ctx->parts) {
+        ctx->nthreads = ctx->parts;
+    }
+    if (ctx->src == NULL) {
+        ctx->hashes = vmap_malloc(ctx->n * sizeof *ctx->hashes);
+    }
+    ctx->order = vmap_malloc(num_items * sizeof *ctx->order);
+    ctx->counts = vmap_calloc(ctx->nthreads * ctx->parts, sizeof *ctx->counts);
+    ctx->long_bytes =
+        vmap_calloc(ctx->nthreads * ctx->parts, sizeof *ctx->long_bytes);
+    ctx->part_start = vmap_malloc((ctx->parts + 1) * sizeof *ctx->part_start);
+    ctx->part_arena = vmap_malloc((ctx->parts + 1) * sizeof *ctx->part_arena);
+    ctx->part_spills = vmap_malloc(ctx->parts * sizeof *ctx->part_spills);
+    workers = vmap_calloc(ctx->nthreads, sizeof *workers);
+    if ((ctx->n && (ctx->src == NULL) && (ctx->hashes == NULL)) ||
+        (num_items && (ctx->order == NULL)) || (ctx->counts == NULL) ||
+        (ctx->long_bytes == NULL) || (ctx->part_start == NULL) ||
+        (ctx->part_arena == NULL) || (ctx->part_spills == NULL) ||
+        (workers == NULL)) {
+        res = VMAP_OOM;
+        goto done;
+    }
+    for (t = 0; t < ctx->nthreads; ++t) {
+        workers[t].ctx = ctx;
+        workers[t].id = t;
+    }
+
+    vmap_run_workers(vmap_build_hash, workers, ctx->nthreads);
+    for (t = 0; t < ctx->nthreads; ++t) {
+        if (workers[t].too_long) {
+            res = VMAP_OOM;
+            goto done;
         }
-        if (e->flags & VMAP_DELETED) {
-            vmap_free(e);
-            continue;
+    }
+    arena_len = vmap_build_offsets(ctx);
+    if (arena_len &&
+        (vmap_reserve_keys(ctx->map, arena_len) != VMAP_OK)) {
+        res = VMAP_OOM;
+        goto done;
+    }
+    vmap_run_workers(vmap_build_scatter, workers, ctx->nthreads);
+    vmap_run_workers(vmap_build_fill, workers, ctx->nthreads);
+
+    for (t = 0; t < ctx->nthreads; ++t) {
+        ctx->map->numel += workers[t].numel;
+        if (ctx->map->keys) {
+            ctx->map->keys->dead += workers[t].arena_dead;
         }
-        if (e->flags == VMAP_EMPTY) {
-            vmap_free(e);
-            continue;
+    }
+    ctx->map->numelplusdeleted = ctx->map->numel;
+    if (ctx->map->keys) {
+        ctx->map->keys->len += arena_len;
+    }
+    vmap_build_spills(ctx);
+done:
+    vmap_free(ctx->hashes);
+    vmap_free(ctx->order);
+    vmap_free(ctx->counts);
+    vmap_free(ctx->long_bytes);
+    vmap_free(ctx->part_start);
+    vmap_free(ctx->part_arena);
+    vmap_free(ctx->part_spills);
+    vmap_free(workers);
+    return res;
+}
+
+vmap* vmap_build(vmap_type* type, void** keys, void** values, size_t n,
+                 size_t nthreads) {
+    vmap_build_ctx ctx;
+    /* entries are placed by hash, which a small table would not keep */
+    vmap* map = vmap_new_with_capacity(
+        type, n > VMAP_SMALL_MAX ? n : VMAP_SMALL_MAX + 1);
+    if (map == NULL) {
+        return NULL;
+    }
+    map->min_power = VMAP_MIN_POWER;
+    memset(&ctx, 0, sizeof ctx);
+    ctx.map = map;
+    ctx.keys = keys;
+    ctx.values = values;
+    ctx.n = n;
+    if (vmap_build_run(&ctx, nthreads) != VMAP_OK) {
+        /* the build only fails before any key is stored or freed, so the
+         * caller keeps ownership of type, keys and values */
+        vmap_shared_free(map);
+        vmap_table_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+#if VMAP_BACKWARD_SHIFT
+/* empties slot i, pulling back every later entry of the same probe run that
+ * is allowed to sit in the hole so the table never holds tombstones */
+static void vmap_backward_shift(vmap* map, uint64_t i) {
+    uint64_t mask = ((uint64_t)1 << map->power) - 1;
+    uint64_t hole = i;
+    uint64_t j = (i + 1) & mask;
+    while (map->ctrl[j] != VMAP_EMPTY) {
+        unsigned char* slot = vmap_slot(map, j);
+        uint64_t home = vmap_h1(vmap_rehash(map, slot, map->power)) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            memcpy(vmap_slot(map, hole), slot, map->slot_size);
+            vmap_set_ctrl(map, hole, map->ctrl[j]);
+            hole = j;
         }
-        vmap_key_free(map, e->data);
-        vmap_value_free(map, e->data + offset);
-        vmap_free(e);
+        j = (j + 1) & mask;
     }
-    vmap_free(map->type);
-    vmap_free(map);
+    vmap_set_ctrl(map, hole, VMAP_EMPTY);
+    map->numelplusdeleted--;
 }
+#endif
 
-static int vmap_resize(vmap** map, uint64_t new_power) {
+int vmap_erase(vmap** map, const void* key) {
+    return vmap_erase_hashed(map, key, vmap_find_hash(*map, key));
+}
+
+int vmap_erase_hashed(vmap** map, const void* key, uint64_t hash) {
     vmap* m = *map;
-    uint64_t i, len = (1 << m->power);
-    vmap* new_map = vmap_new_with_cap(m->type, new_power, m->padding);
-    uint64_t (*hash_fn)(const void* key) = m->type->hash;
-    uint64_t new_cap = (1 << new_map->power);
-    if (new_map == NULL) {
-        return VMAP_OOM;
+    uint64_t cap = ((uint64_t)1 << m->power);
+    vmap* table = m;
+    uint64_t i, new_power;
+    unsigned char* slot;
+    if (m->mapped_size) {
+        return VMAP_READ_ONLY;
     }
-    for (i = 0; i < len; ++i) {
-        vmap_entry* e = m->entries[i];
-        uint64_t hash;
-        if (e == NULL) {
+    if (m->old) {
+        vmap_resize_step(m, m->type->resize_step);
+    }
+    i = vmap_find_index(m, key, hash);
+    if (i == cap) {
+        if (m->old == NULL) {
+            return VMAP_NO_KEY;
+        }
+        table = m->old;
+        i = vmap_find_index(table, key, hash);
+        if (i == ((uint64_t)1 << table->power)) {
+            return VMAP_NO_KEY;
+        }
+        table->numel--;
+    }
+    slot = vmap_slot(table, i);
+    vmap_value_free(m, vmap_slot_value(m, slot));
+    vmap_slot_drop_key(m, slot);
+    if (vmap_is_small(m)) {
+        /* fill the hole with the last entry to keep the entries packed */
+        uint64_t last = m->numel - 1;
+        if (i != last) {
+            memcpy(slot, vmap_slot(m, last), m->slot_size);
+        }
+        m->ctrl[last] = VMAP_EMPTY;
+        m->numelplusdeleted--;
+        m->numel--;
+        m->changes++;
+        vmap_reclaim_keys(m);
+        return VMAP_OK;
+    }
+#if VMAP_BACKWARD_SHIFT
+    if (table == m) {
+        vmap_backward_shift(m, i);
+    } else {
+        vmap_set_ctrl(table, i, VMAP_DELETED);
+    }
+#else
+    vmap_set_ctrl(table, i, VMAP_DELETED);
+#endif
+    m->numel--;
+    m->changes++;
+    if (m->old) {
+        return VMAP_OK;
+    }
+    vmap_reclaim_keys(m);
+    new_power = vmap_shrink_power(m);
+    if (new_power < m->power) {
+        return vmap_resize(map, new_power);
+    }
+    return VMAP_OK;
+}
+
+int vmap_resize_step(vmap* map, size_t budget) {
+    vmap* old = map->old;
+    uint64_t len;
+    if (old == NULL) {
+        return 0;
+    }
+    len = ((uint64_t)1 << old->power);
+    for (; budget && (map->migrate_pos < len); --budget, ++map->migrate_pos) {
+        uint64_t i = map->migrate_pos;
+        unsigned char* slot;
+        uint64_t hash, new_i;
+        if (!vmap_ctrl_is_full(old->ctrl[i])) {
             continue;
         }
-        if (e->flags == VMAP_EMPTY) {
-            vmap_free(e);
+        slot = vmap_slot(old, i);
+        hash = vmap_rehash(old, slot, map->power);
+        new_i = vmap_find_non_full(map, hash);
+        if (map->ctrl[new_i] == VMAP_EMPTY) {
+            map->numelplusdeleted++;
+        }
+        memcpy(vmap_slot(map, new_i), slot, map->slot_size);
+        vmap_set_ctrl(map, new_i, vmap_h2(hash));
+        vmap_set_ctrl(old, i, VMAP_DELETED);
+        old->numel--;
+    }
+    if (map->migrate_pos < len) {
+        return 1;
+    }
+    vmap_table_free(old);
+    map->old = NULL;
+    map->migrate_pos = 0;
+    /* erases skip compaction while the arena is shared by two tables */
+    vmap_compact_keys(map);
+    return 0;
+}
+
+static int vmap_write_zeros(FILE* f, size_t n) {
+    static const unsigned char zeros[64];
+    while (n) {
+        size_t len = n < sizeof zeros ? n : sizeof zeros;
+        if (fwrite(zeros, 1, len, f) != len) {
+            return VMAP_IO_ERROR;
+        }
+        n -= len;
+    }
+    return VMAP_OK;
+}
+
+/* writes the slots and control bytes of map. only the stored hash, key and
+ * value of full slots are copied, padding, the unused tail of inline keys
+ * and empty slots are written as zeros so no stale memory reaches the file */
+static int vmap_write_slots(FILE* f, vmap* map) {
+    uint64_t i, cap = (uint64_t)1 << map->power;
+    unsigned char* buf = vmap_malloc(map->slot_size);
+    int res = VMAP_OK;
+    if (buf == NULL) {
+        return VMAP_OOM;
+    }
+    for (i = 0; (i < cap) && (res == VMAP_OK); ++i) {
+        const unsigned char* slot = vmap_slot(map, i);
+        memset(buf, 0, map->slot_size);
+        if (vmap_ctrl_is_full(map->ctrl[i])) {
+            size_t key_len = map->key_size;
+            if (map->keys) {
+                const vmap_var_key* k =
+                    (const vmap_var_key*)vmap_slot_key(slot);
+                key_len = offsetof(vmap_var_key, data) +
+                          (k->len <= VMAP_INLINE_KEY_SIZE ? k->len
+                                                          : sizeof(uint64_t));
+            }
+            memcpy(buf, slot, VMAP_HDR_SIZE + key_len);
+            memcpy(vmap_slot_value(map, buf), vmap_slot_value(map, slot),
+                   map->type->value_size);
+        }
+        if (fwrite(buf, 1, map->slot_size, f) != map->slot_size) {
+            res = VMAP_IO_ERROR;
+        }
+    }
+    vmap_free(buf);
+    if ((res == VMAP_OK) &&
+        (fwrite(map->ctrl, 1, cap + VMAP_GROUP_MAX, f) !=
+         cap + VMAP_GROUP_MAX)) {
+        res = VMAP_IO_ERROR;
+    }
+    return res;
+}
+
+int vmap_save(vmap* map, const char* path) {
+    vmap_snapshot snap;
+    vmap table;
+    size_t table_size = vmap_table_size(map->type, map->power);
+    size_t keys_len = map->keys ? map->keys->len : 0;
+    int res = VMAP_OK;
+    FILE* f;
+    /* the image holds a single table */
+    while (vmap_resize_step(map, (size_t)-1))
+        ;
+    memset(&snap, 0, sizeof snap);
+    memcpy(snap.magic, VMAP_SNAPSHOT_MAGIC, sizeof snap.magic);
+    snap.version = VMAP_SNAPSHOT_VERSION;
+    snap.byte_order = VMAP_SNAPSHOT_BYTE_ORDER;
+    snap.hash_bits = VMAP_HASH_BITS;
+    snap.inline_key_size = VMAP_INLINE_KEY_SIZE;
+    snap.key_size = map->type->key_size;
+    snap.value_size = map->type->value_size;
+    snap.power = map->power;
+    snap.table_size = table_size;
+    snap.keys_len = keys_len;
+    memcpy(&table, map, sizeof table);
+    table.type = NULL;
+    table.keys = NULL;
+#if VMAP_STATS
+    table.counters = NULL;
+#endif
+    table.old = NULL;
+    table.mapped_size = 0;
+    table.ctrl = NULL;
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        return VMAP_IO_ERROR;
+    }
+    if ((fwrite(&snap, sizeof snap, 1, f) != 1) ||
+        (vmap_write_zeros(f, VMAP_SNAPSHOT_TABLE_OFFSET - sizeof snap) !=
+         VMAP_OK) ||
+        (fwrite(&table, sizeof table, 1, f) != 1) ||
+        (vmap_write_slots(f, map) != VMAP_OK) ||
+        (keys_len && (fwrite(map->keys->data, 1, keys_len, f) != keys_len))) {
+        res = VMAP_IO_ERROR;
+    }
+    if (fclose(f) != 0) {
+        res = VMAP_IO_ERROR;
+    }
+    return res;
+}
+
+/* checks a mapped snapshot of size bytes against type before anything in it
+ * is used. the table header must be what this build would have written for
+ * type, so no size or offset from the file is trusted */
+static int vmap_snapshot_valid(const vmap_snapshot* snap, const vmap* map,
+                               const vmap_type* type, size_t size) {
+    size_t key_size = vmap_type_key_size(type);
+    size_t padding = vmap_padding(key_size);
+    uint64_t cap;
+    if ((memcmp(snap->magic, VMAP_SNAPSHOT_MAGIC, sizeof snap->magic) != 0) ||
+        (snap->version != VMAP_SNAPSHOT_VERSION) ||
+        (snap->byte_order != VMAP_SNAPSHOT_BYTE_ORDER) ||
+        (snap->hash_bits != VMAP_HASH_BITS) ||
+        (snap->inline_key_size != VMAP_INLINE_KEY_SIZE) ||
+        (snap->key_size != type->key_size) ||
+        (snap->value_size != type->value_size) ||
+        (snap->power >= 64) || (snap->power != map->power)) {
+        return 0;
+    }
+    /* a table needs a control byte per slot, which bounds the power before
+     * it goes into any size computation */
+    cap = (uint64_t)1 << snap->power;
+    if ((cap > size) || (snap->keys_len > size) ||
+        (snap->table_size != vmap_table_size(type, snap->power)) ||
+        (VMAP_SNAPSHOT_TABLE_OFFSET + snap->table_size + snap->keys_len !=
+         size)) {
+        return 0;
+    }
+    return (map->key_size == key_size) && (map->padding == padding) &&
+           (map->slot_size ==
+            vmap_slot_size(key_size, padding, type->value_size)) &&
+           (map->grow_at == vmap_grow_at(type, map->power)) &&
+           (map->numel <= map->numelplusdeleted) &&
+           (map->numelplusdeleted <= cap);
+}
+
+/* checks the control bytes and slots of a mapped snapshot against its
+ * header: the counts must match, probing must reach an empty slot and
+ * every long key must lie inside the keys_len bytes of the key arena */
+static int vmap_snapshot_slots_valid(const vmap* map, uint64_t keys_len) {
+    uint64_t i, cap = (uint64_t)1 << map->power;
+    uint64_t full = 0, used = 0;
+    for (i = 0; i < cap; ++i) {
+        uint8_t c = map->ctrl[i];
+        if (vmap_is_small(map) ? (vmap_ctrl_is_full(c) != (i < map->numel))
+                               : ((i < VMAP_GROUP_MAX) &&
+                                  (map->ctrl[cap + i] != c))) {
+            return 0;
+        }
+        used += c != VMAP_EMPTY;
+        if (!vmap_ctrl_is_full(c)) {
             continue;
         }
-        if (e->flags & VMAP_DELETED) {
-            vmap_free(e);
+        full++;
+        if (map->type->key_size == VMAP_VAR_KEYS) {
+            const vmap_var_key* k = (const vmap_var_key*)vmap_slot_key(
+                map->slots + i * map->slot_size);
+            if ((k->len > VMAP_INLINE_KEY_SIZE) &&
+                ((vmap_var_key_offset(k) > keys_len) ||
+                 (k->len > keys_len - vmap_var_key_offset(k)))) {
+                return 0;
+            }
+        }
+    }
+    return (full == map->numel) && (used == map->numelplusdeleted) &&
+           (vmap_is_small(map) || (used < cap));
+}
+
+/* the table header is the only part of the mapping written to, so every
+ * other page stays shared with the page cache and other processes */
+vmap* vmap_open_mapped(const char* path, vmap_type* type) {
+    struct stat st;
+    unsigned char* base;
+    const vmap_snapshot* snap;
+    vmap* map;
+    size_t size;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((fstat(fd, &st) != 0) ||
+        ((size_t)st.st_size < VMAP_SNAPSHOT_TABLE_OFFSET + sizeof *map)) {
+        close(fd);
+        return NULL;
+    }
+    size = (size_t)st.st_size;
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    snap = (const vmap_snapshot*)base;
+    map = (vmap*)(base + VMAP_SNAPSHOT_TABLE_OFFSET);
+    if (!vmap_snapshot_valid(snap, map, type, size)) {
+        munmap(base, size);
+        return NULL;
+    }
+    map->type = type;
+    map->mapped_size = size;
+    map->min_power = map->power;
+    map->old = NULL;
+    map->migrate_pos = 0;
+    map->keys = NULL;
+    map->ctrl = map->slots + ((size_t)1 << map->power) * map->slot_size;
+    if (!vmap_snapshot_slots_valid(map, snap->keys_len)) {
+        munmap(base, size);
+        return NULL;
+    }
+    if (type->key_size == VMAP_VAR_KEYS) {
+        map->keys = (vmap_key_arena*)(base + VMAP_SNAPSHOT_ARENA_OFFSET);
+        map->keys->data =
+            base + VMAP_SNAPSHOT_TABLE_OFFSET + snap->table_size;
+        map->keys->len = snap->keys_len;
+        map->keys->cap = snap->keys_len;
+        map->keys->dead = 0;
+    }
+#if VMAP_STATS
+    map->counters = vmap_type_calloc(type, sizeof *map->counters);
+    if (map->counters == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+#endif
+    return map;
+}
+
+void vmap_stats(vmap* map, vmap_statistics* out) {
+    vmap* table;
+    memset(out, 0, sizeof *out);
+    out->numel = map->numel;
+    out->capacity = (uint64_t)1 << map->power;
+    for (table = map; table; table = table->old) {
+        uint64_t i, len = ((uint64_t)1 << table->power), mask = len - 1;
+        out->numelplusdeleted += table->numelplusdeleted;
+        out->bytes += table->mapped_size
+                          ? table->mapped_size
+                          : vmap_table_size(table->type, table->power);
+        for (i = 0; i < len; i += VMAP_GROUP_WIDTH) {
+            vmap_mask m = vmap_group_match_full(table->ctrl + i);
+            while (m) {
+                uint64_t j = i + vmap_mask_index(m);
+                uint64_t dist = 0;
+                if (!vmap_is_small(table)) {
+                    uint64_t hash =
+                        vmap_rehash(table, vmap_slot(table, j), table->power);
+                    dist = (j - (vmap_h1(hash) & mask)) & mask;
+                }
+                out->probe_histogram[dist < VMAP_PROBE_BUCKETS
+                                         ? dist
+                                         : VMAP_PROBE_BUCKETS - 1]++;
+                out->max_probe = dist > out->max_probe ? dist : out->max_probe;
+                out->total_probe += dist;
+                m = vmap_mask_clear_lowest(m);
+            }
+        }
+    }
+    if (map->keys && (map->mapped_size == 0)) {
+        out->bytes += sizeof *map->keys + map->keys->cap;
+    }
+#if VMAP_STATS
+    out->resizes = map->counters->resizes;
+    out->finds = map->counters->finds;
+    out->hits = map->counters->hits;
+    out->misses = map->counters->misses;
+    out->probes = map->counters->probes;
+#endif
+}
+
+void vmap_iter_init(vmap_iter* it, vmap* map) {
+    memset(it, 0, sizeof *it);
+    it->table = map;
+}
+
+/* scans the control bytes a group at a time so runs of empty slots cost one
+ * compare per group, then moves on to the old table of an incremental
+ * resize, whose unmigrated entries are not in the new one yet */
+int vmap_iter_next(vmap_iter* it) {
+    while (it->table) {
+        vmap* table = it->table;
+        uint64_t len = ((uint64_t)1 << table->power);
+        unsigned char* slot;
+        while ((it->mask == 0) && (it->pos < len)) {
+            it->mask = vmap_group_match_full(table->ctrl + it->pos);
+            it->group = it->pos;
+            it->pos += VMAP_GROUP_WIDTH;
+        }
+        if (it->mask == 0) {
+            it->table = table->old;
+            it->pos = 0;
             continue;
         }
-        hash = hash_fn(e->data) & (new_cap - 1);
-        while (1) {
-            vmap_entry* new_e = new_map->entries[hash];
-            if (new_e != NULL) {
-                hash = (hash + 1) & (new_cap - 1);
-                continue;
+        slot = vmap_slot(table, it->group + vmap_mask_index(it->mask));
+        it->mask = vmap_mask_clear_lowest(it->mask);
+        if (table->keys) {
+            it->var_key = vmap_var_key_get(table, slot);
+            it->key = &it->var_key;
+        } else {
+            it->key = vmap_slot_key(slot);
+        }
+        it->value = vmap_slot_value(table, slot);
+        return 1;
+    }
+    return 0;
+}
+
+static void vmap_free_entries(vmap* map) {
+    size_t i, len = ((size_t)1 << map->power);
+    if ((map->type->key_free == NULL) && (map->type->value_free == NULL)) {
+        return;
+    }
+    for (i = 0; i < len; i += VMAP_GROUP_WIDTH) {
+        vmap_mask m = vmap_group_match_full(map->ctrl + i);
+        while (m) {
+            unsigned char* slot = vmap_slot(map, i + vmap_mask_index(m));
+            if (map->keys == NULL) {
+                vmap_key_free(map, vmap_slot_key(slot));
             }
-            new_map->entries[hash] = e;
-            break;
+            vmap_value_free(map, vmap_slot_value(map, slot));
+            m = vmap_mask_clear_lowest(m);
         }
     }
+}
+
+void vmap_delete(vmap* map) {
+    vmap_type* type;
+    if (map->mapped_size) {
+        type = map->type;
+#if VMAP_STATS
+        vmap_type_free(type, map->counters, sizeof *map->counters);
+#endif
+        munmap((unsigned char*)map - VMAP_SNAPSHOT_TABLE_OFFSET,
+               map->mapped_size);
+        vmap_free(type);
+        return;
+    }
+    if (map->old) {
+        vmap_free_entries(map->old);
+        vmap_table_free(map->old);
+    }
+    vmap_free_entries(map);
+    vmap_shared_free(map);
+    type = map->type;
+    vmap_table_free(map);
+    vmap_free(type);
+}
+
+/* moves every entry of m into the empty table new_map on
+ * m->type->resize_threads threads. each thread fills its own regions of the
+ * new table, entries whose probe run would cross into the next region are
+ * placed afterwards with the usual wrapping probe */
+static int vmap_resize_threaded(vmap* m, vmap* new_map) {
+    vmap_build_ctx ctx;
+    int res;
+    memset(&ctx, 0, sizeof ctx);
+    ctx.map = new_map;
+    ctx.src = m;
+    ctx.n = (size_t)1 << m->power;
+    res = vmap_build_run(&ctx, m->type->resize_threads);
+    if (res != VMAP_OK) {
+        /* nothing was moved out of m, start over on one thread */
+        memset(new_map->ctrl, VMAP_EMPTY,
+               ((size_t)1 << new_map->power) + VMAP_GROUP_MAX);
+        new_map->numel = 0;
+    }
+    return res;
+}
+
+static int vmap_resize(vmap** map, uint64_t new_power) {
+    vmap* m = *map;
+    uint64_t i, len;
+    vmap* new_map;
+    size_t slot_size = m->slot_size;
+    if (m->old) {
+        vmap_resize_step(m, SIZE_MAX);
+    }
+    new_map = vmap_table_new(m->type, new_power);
+    if (new_map == NULL) {
+        return VMAP_OOM;
+    }
+    new_map->min_power = m->min_power;
+    new_map->changes = m->changes + 1;
+    new_map->keys = m->keys;
+#if VMAP_STATS
+    new_map->counters = m->counters;
+#endif
+    vmap_count(new_map, resizes, 1);
+    if (m->type->resize_step && !vmap_is_small(m)) {
+        new_map->old = m;
+        new_map->numel = m->numel;
+        vmap_resize_step(new_map, m->type->resize_step);
+        *map = new_map;
+        return VMAP_OK;
+    }
+    if ((m->type->resize_threads > 1) && !vmap_is_small(m) &&
+        (((size_t)1 << new_power) >= 2 * VMAP_BUILD_MIN_REGION) &&
+        (vmap_resize_threaded(m, new_map) == VMAP_OK)) {
+        goto done;
+    }
+    len = ((uint64_t)1 << m->power);
+    for (i = 0; i < len; i += VMAP_GROUP_WIDTH) {
+        vmap_mask mask = vmap_group_match_full(m->ctrl + i);
+        while (mask) {
+            uint64_t j = i + vmap_mask_index(mask);
+            unsigned char* slot = vmap_slot(m, j);
+            uint64_t hash = vmap_rehash(m, slot, new_power);
+            uint64_t new_i = vmap_find_non_full(new_map, hash);
+            memcpy(vmap_slot(new_map, new_i), slot, slot_size);
+            /* entries of a small table come without their hash */
+            vmap_slot_set_hash(vmap_slot(new_map, new_i), hash);
+            vmap_set_ctrl(new_map, new_i, vmap_h2(hash));
+            mask = vmap_mask_clear_lowest(mask);
+        }
+    }
+done:
     new_map->numel = m->numel;
     new_map->numelplusdeleted = m->numel;
-    free(m);
+    vmap_compact_keys(new_map);
+    vmap_table_free(m);
     *map = new_map;
     return VMAP_OK;
 }
 
-static vmap* vmap_new_with_cap(vmap_type* type, uint64_t power,
-                               size_t padding) {
+size_t vmap_initial_bytes(const vmap_type* type) {
+    return vmap_table_size(type, VMAP_SMALL_POWER);
+}
+
+static vmap* vmap_table_new(vmap_type* type, uint64_t power) {
     vmap* map;
-    size_t cap = (1 << power);
-    size_t needed = (sizeof *map) + (cap * sizeof(vmap_entry*));
-    map = vmap_malloc(needed);
+    size_t cap = ((size_t)1 << power);
+    size_t key_size = vmap_type_key_size(type);
+    size_t padding = vmap_padding(key_size);
+    size_t slot_size = vmap_slot_size(key_size, padding, type->value_size);
+    size_t slots_size = cap * slot_size;
+    size_t needed = vmap_table_size(type, power);
+    map = vmap_type_alloc(type, needed);
     if (map == NULL) {
         return NULL;
     }
-    memset(map, 0, needed);
+    memset(map, 0, (sizeof *map));
     map->type = type;
     map->power = power;
+    map->key_size = key_size;
     map->padding = padding;
+    map->slot_size = slot_size;
+    map->grow_at = vmap_grow_at(type, power);
+    map->ctrl = map->slots + slots_size;
+    memset(map->ctrl, VMAP_EMPTY, cap + VMAP_GROUP_MAX);
     return map;
 }
-
-static vmap_entry* vmap_entry_new(vmap* map, void* key, void* value) {
-    vmap_entry* e;
-    size_t key_size = map->type->key_size;
-    size_t value_size = map->type->value_size;
-    size_t padding = map->padding;
-    size_t needed = (sizeof *e) + key_size + value_size + padding;
-    e = vmap_malloc(needed);
-    if (e == NULL) {
-        return NULL;
-    }
-    memset(e, 0, needed);
-    e->flags |= VMAP_FULL;
-    memcpy(e->data, key, key_size);
-    memcpy(e->data + key_size + padding, value, value_size);
-    return e;
-}
@@ -18,9 +18,28 @@
 #define VMAP_OK 0
 #define VMAP_OOM 1
 #define VMAP_NO_KEY 2
+#define VMAP_IO_ERROR 3
+#define VMAP_READ_ONLY 4
+
+/* vmap_type.key_size for maps whose keys vary in length. every key passed
+ * to such a map, and to its hash and key_cmp, is a pointer to a vmap_key */
+#define VMAP_VAR_KEYS 0
+
+/* vmap_type.min_load that keeps a map from ever shrinking */
+#define VMAP_NO_SHRINK (-1.0)
 
 typedef struct vmap vmap;
-typedef struct vmap_entry vmap_entry;
+
+typedef struct {
+    const void* data;
+    size_t len;
+} vmap_key;
+
+typedef struct {
+    void* (*alloc)(void* ctx, size_t size);
+    void (*free)(void* ctx, void* ptr, size_t size);
+    void* ctx;
+} vmap_allocator;
 
 typedef struct {
     uint64_t (*hash)(const void* key);
@@ -29,12 +48,151 @@ typedef struct {
     void (*value_free)(void* value);
     size_t key_size;
     size_t value_size;
+    /* when non zero, resizes are spread out by moving this many slots of
+     * the old table on every insert, find and erase */
+    size_t resize_step;
+    /* when above 1, full resizes of large tables rehash on this many
+     * threads. ignored while resize_step is set */
+    size_t resize_threads;
+    /* load factors to grow and shrink at, the vmap_config.h defaults when
+     * 0 */
+    double max_load;
+    double min_load;
+    /* where the map's tables, key arena and vmap_stats counters are
+     * allocated from, vmap_malloc when NULL. the scratch space vmap_build
+     * and threaded resizes free before returning comes from vmap_malloc */
+    vmap_allocator* allocator;
 } vmap_type;
 
+/* number of buckets in vmap_statistics.probe_histogram */
+#define VMAP_PROBE_BUCKETS 16
+
+typedef struct {
+    uint64_t numel;
+    /* entries plus tombstones */
+    uint64_t numelplusdeleted;
+    uint64_t capacity;
+    /* memory held by the map's tables and key arena */
+    size_t bytes;
+    /* entries by distance in slots from their home slot, the last bucket
+     * counts every distance of VMAP_PROBE_BUCKETS - 1 or more */
+    uint64_t probe_histogram[VMAP_PROBE_BUCKETS];
+    uint64_t max_probe;
+    /* sum of every entry's distance from its home slot */
+    uint64_t total_probe;
+    /* totals since the map was created, only counted when VMAP_STATS is
+     * set in vmap_config.h and 0 otherwise. probes counts control byte
+     * groups examined by lookups */
+    uint64_t resizes;
+    uint64_t finds;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t probes;
+} vmap_statistics;
+
+/* walks every entry of a map in slot order. key is a vmap_key* for
+ * VMAP_VAR_KEYS maps. changing the map, or calling vmap_find on it while an
+ * incremental resize is in progress, invalidates the iterator */
+typedef struct {
+    const void* key;
+    const void* value;
+    vmap* table;
+    uint64_t pos;
+    uint64_t group;
+    uint64_t mask;
+    vmap_key var_key;
+} vmap_iter;
+
+/* where vmap_find_hint found a missing key would go, so vmap_insert_hint can
+ * put it there without hashing or probing again. a hint taken before the
+ * map last changed only saves the hashing */
+typedef struct {
+    vmap* table;
+    uint64_t hash;
+    uint64_t pos;
+    uint64_t changes;
+} vmap_hint;
+
+#define vmap_foreach(map, it)                                                  \
+    for (vmap_iter_init(&(it), (map)); vmap_iter_next(&(it));)
+
 vmap* vmap_new(vmap_type* type);
+/* capacity is a number of entries, the map never shrinks below it */
+vmap* vmap_new_with_capacity(vmap_type* type, size_t capacity);
+int vmap_reserve(vmap** map, size_t capacity);
 void vmap_delete(vmap* map);
 int vmap_insert(vmap** map, void* key, void* value);
 const void* vmap_find(vmap* map, const void* key);
+/* returns a pointer to key's value that can be updated in place, adding key
+ * with a zeroed value first when it is missing, all with one probe.
+ * *inserted, when not NULL, is set to whether key was added. like
+ * vmap_insert the map takes key, so a key that was already present is freed
+ * with key_free. the pointer is good until the next call on the map.
+ * returns NULL when out of memory or the map is read only */
+void* vmap_get_or_insert(vmap** map, void* key, int* inserted);
+/* vmap_insert without the value copy: returns the value slot of key for the
+ * caller to write, after value_free on the value it replaces. slots hold
+ * keys inline, so a key that is added is still copied in once. a key that
+ * is already present is not copied, only freed with key_free */
+void* vmap_emplace(vmap** map, void* key);
+/* vmap_find that also fills in hint for vmap_insert_hint */
+const void* vmap_find_hint(vmap* map, const void* key, vmap_hint* hint);
+/* inserts a key that vmap_find_hint just reported missing without hashing
+ * or probing again. the key and value are copied in as by vmap_insert */
+int vmap_insert_hint(vmap** map, void* key, void* value,
+                     const vmap_hint* hint);
 int vmap_erase(vmap** map, const void* key);
+/* looks up n keys, storing each value or NULL in out_values, and returns
+ * how many were found */
+size_t vmap_find_batch(vmap* map, const void** keys, size_t n,
+                       const void** out_values);
+int vmap_insert_batch(vmap** map, void** keys, void** values, size_t n);
+/* creates a map holding n key value pairs, as if inserted in order, using
+ * up to nthreads threads. the table is sized once for n entries and split
+ * into disjoint regions that threads fill without locking. returns NULL,
+ * with none of the keys or values freed, when memory runs out or a key is
+ * too long to store */
+vmap* vmap_build(vmap_type* type, void** keys, void** values, size_t n,
+                 size_t nthreads);
+/* moves up to budget slots of an in progress incremental resize, returns
+ * non zero while there is still work left */
+int vmap_resize_step(vmap* map, size_t budget);
+/* writes an image of the map to path that vmap_open_mapped can serve
+ * lookups from. keys and values are copied byte for byte so they must not
+ * hold pointers */
+int vmap_save(vmap* map, const char* path);
+/* maps a file written by vmap_save without copying it. type must have the
+ * same key_size, value_size and hash function the map was saved with.
+ * opening reads every control byte, and every full slot of a VMAP_VAR_KEYS
+ * map, to reject files whose slots do not match their header. inserts and
+ * erases on the result return VMAP_READ_ONLY */
+vmap* vmap_open_mapped(const char* path, vmap_type* type);
+/* fills out with the map's size, memory use and probe distances, which
+ * takes a walk over every slot */
+void vmap_stats(vmap* map, vmap_statistics* out);
+void vmap_iter_init(vmap_iter* it, vmap* map);
+/* moves to the next entry, returns 0 once there are none left */
+int vmap_iter_next(vmap_iter* it);
+/* the hash a map uses for key, type->hash(key). the _hashed calls take it
+ * in place of hashing the key again, so a key can be hashed once and then
+ * looked up, inserted and erased, in any map with the same hash function.
+ * passing any other hash for a key corrupts the map */
+uint64_t vmap_hash(const vmap* map, const void* key);
+int vmap_insert_hashed(vmap** map, void* key, void* value, uint64_t hash);
+const void* vmap_find_hashed(vmap* map, const void* key, uint64_t hash);
+int vmap_erase_hashed(vmap** map, const void* key, uint64_t hash);
+void* vmap_get_or_insert_hashed(vmap** map, void* key, uint64_t hash,
+                                int* inserted);
+void* vmap_emplace_hashed(vmap** map, void* key, uint64_t hash);
+const void* vmap_find_hint_hashed(vmap* map, const void* key, uint64_t hash,
+                                  vmap_hint* hint);
+/* hashes[i] is the hash of keys[i] */
+size_t vmap_find_batch_hashed(vmap* map, const void** keys,
+                              const uint64_t* hashes, size_t n,
+                              const void** out_values);
+int vmap_insert_batch_hashed(vmap** map, void** keys, void** values,
+                             const uint64_t* hashes, size_t n);
+/* number of bytes vmap_new asks the allocator for */
+size_t vmap_initial_bytes(const vmap_type* type);
 
 #endif /* __VMAP_H__ */
@@ -0,0 +1,143 @@
+#include "vmap_alloc.h"
+
+#define VMAP_ALLOC_ALIGN 16
+
+#define vmap_align_up(size)                                                    \
+    (((size) + VMAP_ALLOC_ALIGN - 1) & ~((size_t)VMAP_ALLOC_ALIGN - 1))
+
+struct vmap_alloc_chunk {
+    vmap_alloc_chunk* next;
+    size_t size;
+};
+
+#define VMAP_CHUNK_HDR_SIZE vmap_align_up(sizeof(vmap_alloc_chunk))
+
+#define vmap_chunk_data(chunk) ((unsigned char*)(chunk) + VMAP_CHUNK_HDR_SIZE)
+
+static vmap_alloc_chunk* vmap_chunk_new(vmap_alloc_chunk* next, size_t size) {
+    vmap_alloc_chunk* chunk = vmap_malloc(VMAP_CHUNK_HDR_SIZE + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = next;
+    chunk->size = size;
+    return chunk;
+}
+
+static void vmap_chunks_free(vmap_alloc_chunk* chunk) {
+    while (chunk) {
+        vmap_alloc_chunk* next = chunk->next;
+        vmap_free(chunk);
+        chunk = next;
+    }
+}
+
+static void* vmap_slab_alloc(void* ctx, size_t size) {
+    vmap_slab* slab = ctx;
+    void* block;
+    if (size > slab->block_size) {
+        return vmap_malloc(size);
+    }
+    if (slab->free_list) {
+        block = slab->free_list;
+        memcpy(&slab->free_list, block, sizeof(void*));
+        return block;
+    }
+    if ((slab->chunks == NULL) ||
+        (slab->used + slab->block_size > slab->chunks->size)) {
+        vmap_alloc_chunk* chunk = vmap_chunk_new(
+            slab->chunks, slab->block_size * slab->blocks_per_chunk);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        slab->chunks = chunk;
+        slab->used = 0;
+    }
+    block = vmap_chunk_data(slab->chunks) + slab->used;
+    slab->used += slab->block_size;
+    return block;
+}
+
+static void vmap_slab_dealloc(void* ctx, void* ptr, size_t size) {
+    vmap_slab* slab = ctx;
+    if (size > slab->block_size) {
+        vmap_free(ptr);
+        return;
+    }
+    memcpy(ptr, &slab->free_list, sizeof(void*));
+    slab->free_list = ptr;
+}
+
+void vmap_slab_init(vmap_slab* slab, size_t block_size,
+                    size_t blocks_per_chunk) {
+    memset(slab, 0, sizeof *slab);
+    if (block_size < sizeof(void*)) {
+        block_size = sizeof(void*);
+    }
+    if (blocks_per_chunk == 0) {
+        blocks_per_chunk = 1;
+    }
+    slab->allocator.alloc = vmap_slab_alloc;
+    slab->allocator.free = vmap_slab_dealloc;
+    slab->allocator.ctx = slab;
+    slab->block_size = vmap_align_up(block_size);
+    slab->blocks_per_chunk = blocks_per_chunk;
+}
+
+void vmap_slab_free(vmap_slab* slab) {
+    vmap_chunks_free(slab->chunks);
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+    slab->used = 0;
+}
+
+static void* vmap_arena_alloc(void* ctx, size_t size) {
+    vmap_arena* arena = ctx;
+    void* ptr;
+    size = vmap_align_up(size);
+    if ((arena->chunks == NULL) ||
+        (arena->used + size > arena->chunks->size)) {
+        size_t chunk_size =
+            size > arena->chunk_size ? size : arena->chunk_size;
+        vmap_alloc_chunk* chunk = vmap_chunk_new(arena->chunks, chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+    ptr = vmap_chunk_data(arena->chunks) + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+static void vmap_arena_dealloc(void* ctx, void* ptr, size_t size) {
+    (void)ctx;
+    (void)ptr;
+    (void)size;
+}
+
+void vmap_arena_init(vmap_arena* arena, size_t chunk_size) {
+    memset(arena, 0, sizeof *arena);
+    arena->allocator.alloc = vmap_arena_alloc;
+    arena->allocator.free = vmap_arena_dealloc;
+    arena->allocator.ctx = arena;
+    arena->chunk_size = vmap_align_up(chunk_size);
+}
+
+void vmap_arena_reset(vmap_arena* arena) {
+    vmap_alloc_chunk* chunk = arena->chunks;
+    if (chunk == NULL) {
+        return;
+    }
+    /* keep the most recent chunk around for the next round of maps */
+    vmap_chunks_free(chunk->next);
+    chunk->next = NULL;
+    arena->used = 0;
+}
+
+void vmap_arena_free(vmap_arena* arena) {
+    vmap_chunks_free(arena->chunks);
+    arena->chunks = NULL;
+    arena->used = 0;
+}
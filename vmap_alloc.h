@@ -0,0 +1,38 @@
+#ifndef __VMAP_ALLOC_H__
+
+#define __VMAP_ALLOC_H__
+
+#include "vmap.h"
+
+typedef struct vmap_alloc_chunk vmap_alloc_chunk;
+
+/* hands out blocks of one fixed size from large chunks and keeps freed
+ * blocks on a free list. requests bigger than the block size go straight to
+ * vmap_malloc */
+typedef struct {
+    vmap_allocator allocator;
+    size_t block_size;
+    size_t blocks_per_chunk;
+    size_t used;
+    void* free_list;
+    vmap_alloc_chunk* chunks;
+} vmap_slab;
+
+/* bump allocator, freeing a single allocation is a no op and everything is
+ * released at once by vmap_arena_reset or vmap_arena_free */
+typedef struct {
+    vmap_allocator allocator;
+    size_t chunk_size;
+    size_t used;
+    vmap_alloc_chunk* chunks;
+} vmap_arena;
+
+void vmap_slab_init(vmap_slab* slab, size_t block_size,
+                    size_t blocks_per_chunk);
+void vmap_slab_free(vmap_slab* slab);
+
+void vmap_arena_init(vmap_arena* arena, size_t chunk_size);
+void vmap_arena_reset(vmap_arena* arena);
+void vmap_arena_free(vmap_arena* arena);
+
+#endif /* __VMAP_ALLOC_H__ */
@@ -0,0 +1,408 @@
+#include "vmap_concurrent.h"
+
+#define VMAP_CC_INITIAL_POWER 5
+
+/* the writer tries to reclaim once this many objects are waiting */
+#define VMAP_CC_RECLAIM_AT 64
+
+#define VMAP_READER_IDLE UINT64_MAX
+
+#define VMAP_CACHE_LINE 64
+
+#define vmap_key_free(map, key)                                                \
+    do {                                                                       \
+        if ((map)->type->key_free) {                                           \
+            (map)->type->key_free((key));                                      \
+        }                                                                      \
+    } while (0)
+
+#define vmap_value_free(map, value)                                            \
+    do {                                                                       \
+        if ((map)->type->value_free) {                                         \
+            (map)->type->value_free((value));                                  \
+        }                                                                      \
+    } while (0)
+
+#define vmap_key_cmp(map, a, b)                                                \
+    ((map)->type->key_cmp ? (map)->type->key_cmp((a), (b))                     \
+                          : memcmp((a), (b), (map)->type->key_size))
+
+typedef struct {
+    uint64_t hash;
+    unsigned char data[];
+} vmap_cc_entry;
+
+typedef struct {
+    uint64_t power;
+    vmap_cc_entry* slots[];
+} vmap_cc_table;
+
+typedef enum {
+    VMAP_RETIRED_ENTRY,
+    VMAP_RETIRED_VALUE,
+    VMAP_RETIRED_TABLE,
+} vmap_retired_kind;
+
+typedef struct {
+    void* ptr;
+    uint64_t epoch;
+    vmap_retired_kind kind;
+} vmap_retired;
+
+/* aligned to a cache line so readers do not share one, the map itself is
+ * allocated on a cache line boundary for this to hold */
+struct vmap_reader {
+    uint64_t epoch;
+    uint64_t in_use;
+    vmap_concurrent* map;
+} __attribute__((aligned(VMAP_CACHE_LINE)));
+
+struct vmap_concurrent {
+    vmap_type* type;
+    vmap_cc_table* table;
+    uint64_t epoch;
+    uint64_t numel;
+    uint64_t used;
+    uint64_t grow_at;
+    size_t padding;
+    size_t entry_size;
+    size_t retired_len;
+    size_t retired_cap;
+    vmap_retired* retired;
+    void* base;
+    vmap_reader readers[VMAP_MAX_READERS];
+};
+
+static uint64_t vmap_cc_tombstone;
+
+#define VMAP_TOMBSTONE ((vmap_cc_entry*)&vmap_cc_tombstone)
+
+#define vmap_entry_value(map, e)                                               \
+    ((e)->data + (map)->type->key_size + (map)->padding)
+
+#define vmap_table_size(power)                                                 \
+    ((sizeof(vmap_cc_table)) + (((size_t)1 << (power)) * sizeof(void*)))
+
+static void* vmap_cc_alloc(vmap_concurrent* map, size_t size) {
+    vmap_allocator* allocator = map->type->allocator;
+    if (allocator) {
+        return allocator->alloc(allocator->ctx, size);
+    }
+    return vmap_malloc(size);
+}
+
+static void vmap_cc_dealloc(vmap_concurrent* map, void* ptr, size_t size) {
+    vmap_allocator* allocator = map->type->allocator;
+    if (allocator) {
+        allocator->free(allocator->ctx, ptr, size);
+        return;
+    }
+    vmap_free(ptr);
+}
+
+static vmap_cc_table* vmap_cc_table_new(vmap_concurrent* map, uint64_t power) {
+    vmap_cc_table* table = vmap_cc_alloc(map, vmap_table_size(power));
+    if (table == NULL) {
+        return NULL;
+    }
+    memset(table, 0, vmap_table_size(power));
+    table->power = power;
+    return table;
+}
+
+static void vmap_retired_free(vmap_concurrent* map, vmap_retired* r) {
+    vmap_cc_entry* e = r->ptr;
+    switch (r->kind) {
+    case VMAP_RETIRED_ENTRY:
+        vmap_key_free(map, e->data);
+        vmap_value_free(map, vmap_entry_value(map, e));
+        vmap_cc_dealloc(map, e, map->entry_size);
+        break;
+    case VMAP_RETIRED_VALUE:
+        vmap_value_free(map, vmap_entry_value(map, e));
+        vmap_cc_dealloc(map, e, map->entry_size);
+        break;
+    case VMAP_RETIRED_TABLE:
+        vmap_cc_dealloc(map, r->ptr,
+                        vmap_table_size(((vmap_cc_table*)r->ptr)->power));
+        break;
+    }
+}
+
+void vmap_concurrent_reclaim(vmap_concurrent* map) {
+    uint64_t min = VMAP_READER_IDLE;
+    size_t i, len = 0;
+    __atomic_add_fetch(&map->epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < VMAP_MAX_READERS; ++i) {
+        vmap_reader* r = &map->readers[i];
+        uint64_t epoch;
+        if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (epoch < min) {
+            min = epoch;
+        }
+    }
+    for (i = 0; i < map->retired_len; ++i) {
+        vmap_retired* r = &map->retired[i];
+        if (r->epoch < min) {
+            vmap_retired_free(map, r);
+            continue;
+        }
+        map->retired[len++] = *r;
+    }
+    map->retired_len = len;
+}
+
+/* makes room for one more retired pointer, called before the writer
+ * publishes anything so a failure leaves the map unchanged */
+static int vmap_retire_reserve(vmap_concurrent* map) {
+    size_t cap;
+    void* tmp;
+    if (map->retired_len < map->retired_cap) {
+        return VMAP_OK;
+    }
+    cap = map->retired_cap ? map->retired_cap << 1 : 64;
+    tmp = vmap_realloc(map->retired, cap * sizeof *map->retired);
+    if (tmp != NULL) {
+        map->retired = tmp;
+        map->retired_cap = cap;
+        return VMAP_OK;
+    }
+    vmap_concurrent_reclaim(map);
+    return map->retired_len < map->retired_cap ? VMAP_OK : VMAP_OOM;
+}
+
+/* queues ptr to be freed once every reader that might still see it has
+ * left its read section, room has to be reserved first */
+static void vmap_retire(vmap_concurrent* map, void* ptr,
+                        vmap_retired_kind kind) {
+    vmap_retired* r = &map->retired[map->retired_len++];
+    r->ptr = ptr;
+    r->epoch = __atomic_load_n(&map->epoch, __ATOMIC_ACQUIRE);
+    r->kind = kind;
+    if (map->retired_len >= VMAP_CC_RECLAIM_AT) {
+        vmap_concurrent_reclaim(map);
+    }
+}
+
+vmap_concurrent* vmap_concurrent_new(vmap_type* type) {
+    vmap_concurrent* map;
+    void* base;
+    double max_load = type->max_load != 0 ? type->max_load : VMAP_MAX_LOAD;
+    if ((type->hash == NULL) || (type->key_size == 0) ||
+        (type->value_size == 0)) {
+        return NULL;
+    }
+    /* vmap_malloc only guarantees max_align_t, over allocate to align the
+     * readers */
+    base = vmap_malloc(sizeof *map + VMAP_CACHE_LINE - 1);
+    if (base == NULL) {
+        return NULL;
+    }
+    map = (vmap_concurrent*)(((uintptr_t)base + VMAP_CACHE_LINE - 1) &
+                             ~(uintptr_t)(VMAP_CACHE_LINE - 1));
+    memset(map, 0, sizeof *map);
+    map->base = base;
+    map->type = type;
+    map->padding = (sizeof(void*) - (type->key_size % sizeof(void*))) &
+                   (sizeof(void*) - 1);
+    map->entry_size = (sizeof(vmap_cc_entry)) + type->key_size +
+                      map->padding + type->value_size;
+    map->table = vmap_cc_table_new(map, VMAP_CC_INITIAL_POWER);
+    if (map->table == NULL) {
+        vmap_free(base);
+        return NULL;
+    }
+    map->grow_at =
+        (uint64_t)((double)((uint64_t)1 << VMAP_CC_INITIAL_POWER) * max_load);
+    return map;
+}
+
+void vmap_concurrent_delete(vmap_concurrent* map) {
+    vmap_cc_table* table = map->table;
+    uint64_t i, len = ((uint64_t)1 << table->power);
+    for (i = 0; i < len; ++i) {
+        vmap_cc_entry* e = table->slots[i];
+        if ((e == NULL) || (e == VMAP_TOMBSTONE)) {
+            continue;
+        }
+        vmap_key_free(map, e->data);
+        vmap_value_free(map, vmap_entry_value(map, e));
+        vmap_cc_dealloc(map, e, map->entry_size);
+    }
+    vmap_cc_dealloc(map, table, vmap_table_size(table->power));
+    for (i = 0; i < map->retired_len; ++i) {
+        vmap_retired_free(map, &map->retired[i]);
+    }
+    vmap_free(map->retired);
+    vmap_free(map->type);
+    vmap_free(map->base);
+}
+
+/* builds a table of the given size from the live entries and publishes it,
+ * readers already probing the old table keep using it until they are done */
+static int vmap_cc_resize(vmap_concurrent* map, uint64_t power) {
+    vmap_cc_table* old = map->table;
+    vmap_cc_table* table;
+    uint64_t i, len = ((uint64_t)1 << old->power);
+    uint64_t mask = ((uint64_t)1 << power) - 1;
+    double max_load =
+        map->type->max_load != 0 ? map->type->max_load : VMAP_MAX_LOAD;
+    if (vmap_retire_reserve(map) != VMAP_OK) {
+        return VMAP_OOM;
+    }
+    table = vmap_cc_table_new(map, power);
+    if (table == NULL) {
+        return VMAP_OOM;
+    }
+    for (i = 0; i < len; ++i) {
+        vmap_cc_entry* e = old->slots[i];
+        uint64_t j;
+        if ((e == NULL) || (e == VMAP_TOMBSTONE)) {
+            continue;
+        }
+        j = e->hash & mask;
+        while (table->slots[j] != NULL) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j] = e;
+    }
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    map->used = map->numel;
+    map->grow_at = (uint64_t)((double)(mask + 1) * max_load);
+    vmap_retire(map, old, VMAP_RETIRED_TABLE);
+    return VMAP_OK;
+}
+
+int vmap_concurrent_insert(vmap_concurrent* map, void* key, void* value) {
+    uint64_t hash = map->type->hash(key);
+    vmap_cc_table* table = map->table;
+    uint64_t mask = ((uint64_t)1 << table->power) - 1;
+    uint64_t i = hash & mask, free_slot = mask + 1;
+    vmap_cc_entry* e;
+    while ((e = table->slots[i]) != NULL) {
+        if (e == VMAP_TOMBSTONE) {
+            if (free_slot > mask) {
+                free_slot = i;
+            }
+        } else if ((e->hash == hash) &&
+                   (vmap_key_cmp(map, e->data, key) == 0)) {
+            vmap_cc_entry* new_e;
+            if (vmap_retire_reserve(map) != VMAP_OK) {
+                return VMAP_OOM;
+            }
+            new_e = vmap_cc_alloc(map, map->entry_size);
+            if (new_e == NULL) {
+                return VMAP_OOM;
+            }
+            memcpy(new_e, e, map->entry_size - map->type->value_size);
+            memcpy(vmap_entry_value(map, new_e), value, map->type->value_size);
+            __atomic_store_n(&table->slots[i], new_e, __ATOMIC_RELEASE);
+            vmap_key_free(map, key);
+            vmap_retire(map, e, VMAP_RETIRED_VALUE);
+            return VMAP_OK;
+        }
+        i = (i + 1) & mask;
+    }
+    if (free_slot > mask) {
+        if (map->used + 1 > map->grow_at) {
+            uint64_t power = table->power;
+            int res;
+            if (map->numel + 1 > map->grow_at / 2) {
+                power++;
+            }
+            res = vmap_cc_resize(map, power);
+            if (res != VMAP_OK) {
+                return res;
+            }
+            return vmap_concurrent_insert(map, key, value);
+        }
+        free_slot = i;
+        map->used++;
+    }
+    e = vmap_cc_alloc(map, map->entry_size);
+    if (e == NULL) {
+        return VMAP_OOM;
+    }
+    e->hash = hash;
+    memcpy(e->data, key, map->type->key_size);
+    memcpy(vmap_entry_value(map, e), value, map->type->value_size);
+    __atomic_store_n(&table->slots[free_slot], e, __ATOMIC_RELEASE);
+    map->numel++;
+    return VMAP_OK;
+}
+
+int vmap_concurrent_erase(vmap_concurrent* map, const void* key) {
+    uint64_t hash = map->type->hash(key);
+    vmap_cc_table* table = map->table;
+    uint64_t mask = ((uint64_t)1 << table->power) - 1;
+    uint64_t i = hash & mask;
+    vmap_cc_entry* e;
+    while ((e = table->slots[i]) != NULL) {
+        if ((e != VMAP_TOMBSTONE) && (e->hash == hash) &&
+            (vmap_key_cmp(map, e->data, key) == 0)) {
+            if (vmap_retire_reserve(map) != VMAP_OK) {
+                return VMAP_OOM;
+            }
+            __atomic_store_n(&table->slots[i], VMAP_TOMBSTONE,
+                             __ATOMIC_RELEASE);
+            map->numel--;
+            vmap_retire(map, e, VMAP_RETIRED_ENTRY);
+            return VMAP_OK;
+        }
+        i = (i + 1) & mask;
+    }
+    return VMAP_NO_KEY;
+}
+
+vmap_reader* vmap_reader_register(vmap_concurrent* map) {
+    size_t i;
+    for (i = 0; i < VMAP_MAX_READERS; ++i) {
+        vmap_reader* r = &map->readers[i];
+        uint64_t expected = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&r->epoch, VMAP_READER_IDLE, __ATOMIC_RELEASE);
+            r->map = map;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void vmap_reader_unregister(vmap_reader* reader) {
+    __atomic_store_n(&reader->epoch, VMAP_READER_IDLE, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void vmap_read_begin(vmap_reader* reader) {
+    uint64_t epoch = __atomic_load_n(&reader->map->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&reader->epoch, epoch, __ATOMIC_RELAXED);
+    /* the announcement has to be visible before any table is loaded */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void vmap_read_end(vmap_reader* reader) {
+    __atomic_store_n(&reader->epoch, VMAP_READER_IDLE, __ATOMIC_RELEASE);
+}
+
+const void* vmap_concurrent_find(vmap_concurrent* map, const void* key) {
+    uint64_t hash = map->type->hash(key);
+    vmap_cc_table* table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    uint64_t mask = ((uint64_t)1 << table->power) - 1;
+    uint64_t i = hash & mask;
+    while (1) {
+        vmap_cc_entry* e = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+        if (e == NULL) {
+            return NULL;
+        }
+        if ((e != VMAP_TOMBSTONE) && (e->hash == hash) &&
+            (vmap_key_cmp(map, e->data, key) == 0)) {
+            return vmap_entry_value(map, e);
+        }
+        i = (i + 1) & mask;
+    }
+}
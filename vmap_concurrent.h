@@ -0,0 +1,32 @@
+#ifndef __VMAP_CONCURRENT_H__
+
+#define __VMAP_CONCURRENT_H__
+
+#include "vmap.h"
+
+/* a map with a single writer and any number of lock free readers. readers
+ * register once per thread and wrap every vmap_concurrent_find, and every
+ * use of the value it returns, in vmap_read_begin and vmap_read_end. entries
+ * and tables replaced by the writer are freed once no reader can still see
+ * them */
+typedef struct vmap_concurrent vmap_concurrent;
+typedef struct vmap_reader vmap_reader;
+
+vmap_concurrent* vmap_concurrent_new(vmap_type* type);
+void vmap_concurrent_delete(vmap_concurrent* map);
+
+/* writer side, calls must not overlap each other. insert and erase return
+ * VMAP_OOM and leave the map unchanged when the entry or the space to queue
+ * the replaced one cannot be allocated */
+int vmap_concurrent_insert(vmap_concurrent* map, void* key, void* value);
+int vmap_concurrent_erase(vmap_concurrent* map, const void* key);
+void vmap_concurrent_reclaim(vmap_concurrent* map);
+
+/* reader side, returns NULL once VMAP_MAX_READERS readers are registered */
+vmap_reader* vmap_reader_register(vmap_concurrent* map);
+void vmap_reader_unregister(vmap_reader* reader);
+void vmap_read_begin(vmap_reader* reader);
+void vmap_read_end(vmap_reader* reader);
+const void* vmap_concurrent_find(vmap_concurrent* map, const void* key);
+
+#endif /* __VMAP_CONCURRENT_H__ */
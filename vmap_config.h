@@ -2,4 +2,58 @@
 
 #define __VMAP_CONFIG_H__
 
+/* number of bits of each key's hash cached in its slot so that resizing and
+ * probing do not need to call type->hash or compare keys as often. one of
+ * 64, 32 or 0 to not cache the hash at all */
+#ifndef VMAP_HASH_BITS
+#define VMAP_HASH_BITS 64
+#endif /* VMAP_HASH_BITS */
+
+/* when 1, vmap_erase moves the rest of the probe run back into the freed
+ * slot instead of leaving a tombstone, so lookups never slow down under
+ * churn. set to 0 to use tombstones, which makes erase cheaper */
+#ifndef VMAP_BACKWARD_SHIFT
+#define VMAP_BACKWARD_SHIFT 1
+#endif /* VMAP_BACKWARD_SHIFT */
+
+/* load factors used when vmap_type.max_load or vmap_type.min_load are 0. a
+ * map grows once it is fuller than the max load and shrinks once it is
+ * emptier than the min load */
+#ifndef VMAP_MAX_LOAD
+#define VMAP_MAX_LOAD .7
+#endif /* VMAP_MAX_LOAD */
+
+#ifndef VMAP_MIN_LOAD
+#define VMAP_MIN_LOAD .3
+#endif /* VMAP_MIN_LOAD */
+
+/* keys of a VMAP_VAR_KEYS map up to this many bytes are kept inside the
+ * slot, longer ones go to an arena owned by the map. must be at least 8 */
+#ifndef VMAP_INLINE_KEY_SIZE
+#define VMAP_INLINE_KEY_SIZE 16
+#endif /* VMAP_INLINE_KEY_SIZE */
+
+/* maps start out as a table of up to this many entries kept packed at the
+ * front and found by comparing keys one by one, without hashing. past it
+ * they move to a hashed table. at most 16, 0 to always hash */
+#ifndef VMAP_SMALL_MAX
+#define VMAP_SMALL_MAX 16
+#endif /* VMAP_SMALL_MAX */
+
+/* when 1, maps count resizes, finds, hits, misses and probed groups for
+ * vmap_stats. costs a few increments on every lookup */
+#ifndef VMAP_STATS
+#define VMAP_STATS 0
+#endif /* VMAP_STATS */
+
+/* seed used by the unseeded hash functions in vmap_hash.h */
+#ifndef VMAP_HASH_SEED
+#define VMAP_HASH_SEED 0
+#endif /* VMAP_HASH_SEED */
+
+/* most reader threads that can be registered with one vmap_concurrent */
+#ifndef VMAP_MAX_READERS
+#define VMAP_MAX_READERS 64
+#endif /* VMAP_MAX_READERS */
+
 #endif /* __VMAP_CONFIG_H__ */
@@ -0,0 +1,196 @@
+#ifndef __VMAP_DEFINE_H__
+
+#define __VMAP_DEFINE_H__
+
+#include "vmap.h"
+#include "vmap_group.h"
+
+/* VMAP_DEFINE(name, KeyT, ValT, hash_fn, eq_fn) generates a map type name
+ * specialized for keys of type KeyT and values of type ValT, with:
+ *
+ *   name* name_new(void);
+ *   void name_delete(name* map);
+ *   int name_insert(name* map, KeyT key, ValT value);
+ *   ValT* name_find(const name* map, KeyT key);
+ *   int name_erase(name* map, KeyT key);
+ *
+ * hash_fn is called as uint64_t hash_fn(KeyT) and eq_fn as int eq_fn(KeyT,
+ * KeyT), nonzero when the keys are equal. both are expected to be inlinable
+ * so probing needs no indirect calls, and keys and values are copied by
+ * assignment. the layout and probing match vmap.c but no hash is cached and
+ * erase always shifts the probe run back, so a map never holds tombstones.
+ * the handle stays put across resizes. */
+
+#define VMAP_DEFINE_MIN_POWER 5
+
+#define VMAP_DEFINE(name, KeyT, ValT, hash_fn, eq_fn)                          \
+    typedef struct {                                                           \
+        KeyT key;                                                              \
+        ValT value;                                                            \
+    } name##_slot;                                                             \
+                                                                               \
+    typedef struct {                                                           \
+        size_t numel;                                                          \
+        size_t grow_at;                                                        \
+        uint64_t power;                                                        \
+        uint8_t* ctrl;                                                         \
+        name##_slot* slots;                                                    \
+    } name;                                                                    \
+                                                                               \
+    static inline int name##_table_new(name* map, uint64_t power) {            \
+        size_t cap = ((size_t)1 << power);                                     \
+        name##_slot* slots =                                                   \
+            vmap_malloc((cap * sizeof *slots) + cap + VMAP_GROUP_MAX);         \
+        if (slots == NULL) {                                                   \
+            return VMAP_OOM;                                                   \
+        }                                                                      \
+        map->numel = 0;                                                        \
+        map->grow_at = (size_t)((double)cap * VMAP_MAX_LOAD);                  \
+        map->power = power;                                                    \
+        map->slots = slots;                                                    \
+        map->ctrl = (uint8_t*)(slots + cap);                                   \
+        memset(map->ctrl, VMAP_EMPTY, cap + VMAP_GROUP_MAX);                   \
+        return VMAP_OK;                                                        \
+    }                                                                          \
+                                                                               \
+    static inline void name##_set_ctrl(name* map, uint64_t i, uint8_t c) {     \
+        map->ctrl[i] = c;                                                      \
+        if (i < VMAP_GROUP_MAX) {                                              \
+            map->ctrl[((uint64_t)1 << map->power) + i] = c;                    \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static inline uint64_t name##_find_non_full(const name* map,               \
+                                                uint64_t hash) {               \
+        uint64_t mask = ((uint64_t)1 << map->power) - 1;                       \
+        uint64_t pos = vmap_h1(hash) & mask;                                   \
+        while (1) {                                                            \
+            vmap_mask m = vmap_group_match_non_full(map->ctrl + pos);          \
+            if (m) {                                                           \
+                return (pos + vmap_mask_index(m)) & mask;                      \
+            }                                                                  \
+            pos = (pos + VMAP_GROUP_WIDTH) & mask;                             \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static inline uint64_t name##_find_index(const name* map, KeyT key,        \
+                                             uint64_t hash) {                  \
+        uint64_t mask = ((uint64_t)1 << map->power) - 1;                       \
+        uint64_t pos = vmap_h1(hash) & mask;                                   \
+        uint8_t h2 = vmap_h2(hash);                                            \
+        while (1) {                                                            \
+            const uint8_t* g = map->ctrl + pos;                                \
+            vmap_mask m = vmap_group_match(g, h2);                             \
+            while (m) {                                                        \
+                uint64_t i = (pos + vmap_mask_index(m)) & mask;                \
+                if (eq_fn(map->slots[i].key, key)) {                           \
+                    return i;                                                  \
+                }                                                              \
+                m = vmap_mask_clear_lowest(m);                                 \
+            }                                                                  \
+            if (vmap_group_match_empty(g)) {                                   \
+                return mask + 1;                                               \
+            }                                                                  \
+            pos = (pos + VMAP_GROUP_WIDTH) & mask;                             \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static inline int name##_resize(name* map, uint64_t new_power) {           \
+        name old = *map;                                                       \
+        size_t i, cap = ((size_t)1 << old.power);                              \
+        if (name##_table_new(map, new_power) != VMAP_OK) {                     \
+            *map = old;                                                        \
+            return VMAP_OOM;                                                   \
+        }                                                                      \
+        for (i = 0; i < cap; i += VMAP_GROUP_WIDTH) {                          \
+            vmap_mask m = vmap_group_match_full(old.ctrl + i);                 \
+            while (m) {                                                        \
+                name##_slot* slot = &old.slots[i + vmap_mask_index(m)];        \
+                uint64_t hash = hash_fn(slot->key);                            \
+                uint64_t j = name##_find_non_full(map, hash);                  \
+                map->slots[j] = *slot;                                         \
+                name##_set_ctrl(map, j, vmap_h2(hash));                        \
+                m = vmap_mask_clear_lowest(m);                                 \
+            }                                                                  \
+        }                                                                      \
+        map->numel = old.numel;                                                \
+        vmap_free(old.slots);                                                  \
+        return VMAP_OK;                                                        \
+    }                                                                          \
+                                                                               \
+    static inline name* name##_new(void) {                                     \
+        name* map = vmap_malloc(sizeof *map);                                  \
+        if (map == NULL) {                                                     \
+            return NULL;                                                       \
+        }                                                                      \
+        if (name##_table_new(map, VMAP_DEFINE_MIN_POWER) != VMAP_OK) {         \
+            vmap_free(map);                                                    \
+            return NULL;                                                       \
+        }                                                                      \
+        return map;                                                            \
+    }                                                                          \
+                                                                               \
+    static inline void name##_delete(name* map) {                              \
+        if (map == NULL) {                                                     \
+            return;                                                            \
+        }                                                                      \
+        vmap_free(map->slots);                                                 \
+        vmap_free(map);                                                        \
+    }                                                                          \
+                                                                               \
+    static inline ValT* name##_find(const name* map, KeyT key) {               \
+        uint64_t i = name##_find_index(map, key, hash_fn(key));                \
+        if (i >> map->power) {                                                 \
+            return NULL;                                                       \
+        }                                                                      \
+        return &map->slots[i].value;                                           \
+    }                                                                          \
+                                                                               \
+    static inline int name##_insert(name* map, KeyT key, ValT value) {         \
+        uint64_t hash = hash_fn(key);                                          \
+        uint64_t i = name##_find_index(map, key, hash);                        \
+        if ((i >> map->power) == 0) {                                          \
+            map->slots[i].value = value;                                       \
+            return VMAP_OK;                                                    \
+        }                                                                      \
+        if (map->numel + 1 > map->grow_at) {                                   \
+            if (name##_resize(map, map->power + 1) != VMAP_OK) {               \
+                return VMAP_OOM;                                               \
+            }                                                                  \
+        }                                                                      \
+        i = name##_find_non_full(map, hash);                                   \
+        map->slots[i].key = key;                                               \
+        map->slots[i].value = value;                                           \
+        name##_set_ctrl(map, i, vmap_h2(hash));                                \
+        map->numel++;                                                          \
+        return VMAP_OK;                                                        \
+    }                                                                          \
+                                                                               \
+    static inline int name##_erase(name* map, KeyT key) {                      \
+        uint64_t mask = ((uint64_t)1 << map->power) - 1;                       \
+        uint64_t hole = name##_find_index(map, key, hash_fn(key));             \
+        uint64_t j, power;                                                     \
+        if (hole > mask) {                                                     \
+            return VMAP_NO_KEY;                                                \
+        }                                                                      \
+        for (j = (hole + 1) & mask; map->ctrl[j] != VMAP_EMPTY;                \
+             j = (j + 1) & mask) {                                             \
+            uint64_t home = vmap_h1(hash_fn(map->slots[j].key)) & mask;        \
+            if (((j - home) & mask) >= ((j - hole) & mask)) {                  \
+                map->slots[hole] = map->slots[j];                              \
+                name##_set_ctrl(map, hole, map->ctrl[j]);                      \
+                hole = j;                                                      \
+            }                                                                  \
+        }                                                                      \
+        name##_set_ctrl(map, hole, VMAP_EMPTY);                                \
+        map->numel--;                                                          \
+        power = vmap_shrink_to(map->numel, map->power, VMAP_DEFINE_MIN_POWER,  \
+                               VMAP_MIN_LOAD, VMAP_MAX_LOAD);                  \
+        if (power != map->power) {                                             \
+            /* a failed shrink leaves a valid, just sparser, table */          \
+            (void)name##_resize(map, power);                                   \
+        }                                                                      \
+        return VMAP_OK;                                                        \
+    }
+
+#endif /* __VMAP_DEFINE_H__ */
@@ -0,0 +1,152 @@
+#ifndef __VMAP_GROUP_H__
+
+#define __VMAP_GROUP_H__
+
+/* control bytes and the group probing primitives shared by vmap.c and the
+ * maps generated by vmap_define.h. not part of the public api */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define VMAP_EMPTY ((uint8_t)0x80)
+#define VMAP_DELETED ((uint8_t)0xfe)
+#define vmap_ctrl_is_full(c) (((c) & 0x80) == 0)
+
+/* the first VMAP_GROUP_MAX control bytes are mirrored past the end of the
+ * control array so a group can be loaded from any slot without wrapping */
+#define VMAP_GROUP_MAX 32
+
+/* slots are indexed by the low bits of the hash, the 7 bit fragment kept in
+ * the control byte is a multiplicative mix of the low 32 bits so it still
+ * tells apart keys that share a home slot */
+#define vmap_h1(hash) (hash)
+#define vmap_h2(hash) ((uint8_t)(((uint32_t)(hash)*0x9e3779b1u) >> 25))
+
+#if defined(__AVX2__)
+
+#define VMAP_GROUP_WIDTH 32
+typedef uint32_t vmap_mask;
+
+static inline vmap_mask vmap_group_match(const uint8_t* ctrl, uint8_t h2) {
+    __m256i g = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (vmap_mask)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(g, _mm256_set1_epi8((char)h2)));
+}
+
+static inline vmap_mask vmap_group_match_empty(const uint8_t* ctrl) {
+    __m256i g = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (vmap_mask)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(g, _mm256_set1_epi8((char)VMAP_EMPTY)));
+}
+
+static inline vmap_mask vmap_group_match_non_full(const uint8_t* ctrl) {
+    __m256i g = _mm256_loadu_si256((const __m256i*)ctrl);
+    return (vmap_mask)_mm256_movemask_epi8(g);
+}
+
+static inline vmap_mask vmap_group_match_full(const uint8_t* ctrl) {
+    __m256i g = _mm256_loadu_si256((const __m256i*)ctrl);
+    return ~(vmap_mask)_mm256_movemask_epi8(g);
+}
+
+#define vmap_mask_index(mask) ((size_t)__builtin_ctz(mask))
+
+#elif defined(__SSE2__)
+
+#define VMAP_GROUP_WIDTH 16
+typedef uint32_t vmap_mask;
+
+static inline vmap_mask vmap_group_match(const uint8_t* ctrl, uint8_t h2) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (vmap_mask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(g, _mm_set1_epi8((char)h2)));
+}
+
+static inline vmap_mask vmap_group_match_empty(const uint8_t* ctrl) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (vmap_mask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(g, _mm_set1_epi8((char)VMAP_EMPTY)));
+}
+
+static inline vmap_mask vmap_group_match_non_full(const uint8_t* ctrl) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (vmap_mask)_mm_movemask_epi8(g);
+}
+
+static inline vmap_mask vmap_group_match_full(const uint8_t* ctrl) {
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return ~(vmap_mask)_mm_movemask_epi8(g) & 0xffff;
+}
+
+#define vmap_mask_index(mask) ((size_t)__builtin_ctz(mask))
+
+#else
+
+/* portable fallback: eight control bytes at a time in a uint64_t, with the
+ * result mask holding the high bit of each matching byte */
+#define VMAP_GROUP_WIDTH 8
+typedef uint64_t vmap_mask;
+
+#define VMAP_LSBS 0x0101010101010101ULL
+#define VMAP_MSBS 0x8080808080808080ULL
+
+static inline uint64_t vmap_group_load(const uint8_t* ctrl) {
+    uint64_t g;
+    memcpy(&g, ctrl, sizeof g);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    g = __builtin_bswap64(g);
+#endif
+    return g;
+}
+
+static inline vmap_mask vmap_group_match(const uint8_t* ctrl, uint8_t h2) {
+    uint64_t x = vmap_group_load(ctrl) ^ (VMAP_LSBS * h2);
+    return (x - VMAP_LSBS) & ~x & VMAP_MSBS;
+}
+
+static inline vmap_mask vmap_group_match_empty(const uint8_t* ctrl) {
+    uint64_t g = vmap_group_load(ctrl);
+    return g & ~(g << 6) & VMAP_MSBS;
+}
+
+static inline vmap_mask vmap_group_match_non_full(const uint8_t* ctrl) {
+    return vmap_group_load(ctrl) & VMAP_MSBS;
+}
+
+static inline vmap_mask vmap_group_match_full(const uint8_t* ctrl) {
+    return ~vmap_group_load(ctrl) & VMAP_MSBS;
+}
+
+#define vmap_mask_index(mask) ((size_t)__builtin_ctzll(mask) >> 3)
+
+#endif
+
+#define vmap_mask_clear_lowest(mask) ((mask) & ((mask)-1))
+
+/* the size to shrink to once the load drops under min_load, a negative
+ * min_load never shrinks. the new table must end up no fuller than halfway
+ * between min_load and max_load so that alternating inserts and erases
+ * cannot bounce between two sizes */
+static inline uint64_t vmap_shrink_to(uint64_t numel, uint64_t power,
+                                      uint64_t min_power, double min_load,
+                                      double max_load) {
+    double target = (max_load + min_load) / 2;
+    double n = (double)numel;
+    if (min_load < 0) {
+        return power;
+    }
+    if (n >= min_load * (double)((uint64_t)1 << power)) {
+        return power;
+    }
+    while ((power > min_power) &&
+           (n <= target * (double)((uint64_t)1 << (power - 1)))) {
+        power--;
+    }
+    return power;
+}
+
+#endif /* __VMAP_GROUP_H__ */
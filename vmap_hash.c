@@ -0,0 +1,146 @@
+#include "vmap_hash.h"
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define VMAP_WY0 0xa0761d6478bd642fULL
+#define VMAP_WY1 0xe7037ed1a0b428dbULL
+#define VMAP_WY2 0x8ebc6af09c88c6e3ULL
+#define VMAP_WY3 0x589965cc75374cc3ULL
+
+/* full 128 bit product of a and b, low half in a and high half in b */
+static inline void vmap_mum(uint64_t* a, uint64_t* b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 vmap_u128;
+    vmap_u128 r = (vmap_u128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t lo = t + (rm1 << 32);
+    uint64_t c = (t < rl) + (lo < t);
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t vmap_mix(uint64_t a, uint64_t b) {
+    vmap_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t vmap_read8(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t vmap_read4(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+uint64_t vmap_hash_bytes_seeded(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = data;
+    uint64_t a, b;
+    seed ^= vmap_mix(seed ^ VMAP_WY0, VMAP_WY1);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = (vmap_read4(p) << 32) | vmap_read4(p + mid);
+            b = (vmap_read4(p + len - 4) << 32) | vmap_read4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = vmap_mix(vmap_read8(p) ^ VMAP_WY1,
+                                vmap_read8(p + 8) ^ seed);
+                see1 = vmap_mix(vmap_read8(p + 16) ^ VMAP_WY2,
+                                vmap_read8(p + 24) ^ see1);
+                see2 = vmap_mix(vmap_read8(p + 32) ^ VMAP_WY3,
+                                vmap_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = vmap_mix(vmap_read8(p) ^ VMAP_WY1, vmap_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = vmap_read8(p + i - 16);
+        b = vmap_read8(p + i - 8);
+    }
+    a ^= VMAP_WY1;
+    b ^= seed;
+    vmap_mum(&a, &b);
+    return vmap_mix(a ^ VMAP_WY0 ^ len, b ^ VMAP_WY1);
+}
+
+uint64_t vmap_hash_crc32_seeded(const void* data, size_t len, uint64_t seed) {
+#if VMAP_HASH_HW_CRC32
+    const unsigned char* p = data;
+    uint64_t crc = (uint32_t)seed;
+    size_t n = len;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+#if defined(__SSE4_2__)
+        crc = _mm_crc32_u64(crc, v);
+#else
+        crc = __crc32cd((uint32_t)crc, v);
+#endif
+    }
+    for (; n > 0; n--, p++) {
+#if defined(__SSE4_2__)
+        crc = _mm_crc32_u8((uint32_t)crc, *p);
+#else
+        crc = __crc32cb((uint32_t)crc, *p);
+#endif
+    }
+    /* crc32c only fills 32 bits and maps runs of zeros to the initial value,
+     * so the length goes in the high half before spreading them over 64 */
+    return vmap_hash_u64_seeded(crc | ((uint64_t)len << 32), seed);
+#else
+    return vmap_hash_bytes_seeded(data, len, seed);
+#endif
+}
+
+uint64_t vmap_hash_key_u32(const void* key) {
+    uint32_t k;
+    memcpy(&k, key, sizeof k);
+    return vmap_hash_u32(k);
+}
+
+uint64_t vmap_hash_key_u64(const void* key) {
+    uint64_t k;
+    memcpy(&k, key, sizeof k);
+    return vmap_hash_u64(k);
+}
+
+uint64_t vmap_hash_key_var(const void* key) {
+    const vmap_key* k = key;
+    return vmap_hash_bytes(k->data, k->len);
+}
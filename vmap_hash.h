@@ -0,0 +1,47 @@
+#ifndef __VMAP_HASH_H__
+
+#define __VMAP_HASH_H__
+
+#include "vmap.h"
+
+/* 1 when vmap_hash_crc32 runs on the cpu's crc32c instruction. without it
+ * vmap_hash_crc32 falls back to vmap_hash_bytes */
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+#define VMAP_HASH_HW_CRC32 1
+#else
+#define VMAP_HASH_HW_CRC32 0
+#endif
+
+/* wyhash style hash of len bytes, good for keys of any size */
+uint64_t vmap_hash_bytes_seeded(const void* data, size_t len, uint64_t seed);
+
+/* hash of len bytes built on the crc32c instruction, fastest on short keys
+ * but only as good as crc32c at spreading bits */
+uint64_t vmap_hash_crc32_seeded(const void* data, size_t len, uint64_t seed);
+
+#define vmap_hash_bytes(data, len)                                             \
+    vmap_hash_bytes_seeded((data), (len), VMAP_HASH_SEED)
+#define vmap_hash_crc32(data, len)                                             \
+    vmap_hash_crc32_seeded((data), (len), VMAP_HASH_SEED)
+
+/* murmur3 finalizer, every input bit affects every output bit */
+static inline uint64_t vmap_hash_u64_seeded(uint64_t x, uint64_t seed) {
+    x ^= seed;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+#define vmap_hash_u64(x) vmap_hash_u64_seeded((x), VMAP_HASH_SEED)
+#define vmap_hash_u32(x) vmap_hash_u64_seeded((uint32_t)(x), VMAP_HASH_SEED)
+
+/* ready made vmap_type.hash functions for uint32_t and uint64_t keys and for
+ * VMAP_VAR_KEYS maps */
+uint64_t vmap_hash_key_u32(const void* key);
+uint64_t vmap_hash_key_u64(const void* key);
+uint64_t vmap_hash_key_var(const void* key);
+
+#endif /* __VMAP_HASH_H__ */
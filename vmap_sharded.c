@@ -0,0 +1,117 @@
+#include "vmap_sharded.h"
+#include <pthread.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    vmap* map;
+} vmap_shard;
+
+#define VMAP_SHARD_SIZE (((sizeof(vmap_shard)) + 63) & ~(size_t)63)
+
+struct vmap_sharded {
+    uint64_t shard_bits;
+    size_t num_shards;
+    uint64_t (*hash)(const void* key);
+    size_t value_size;
+    unsigned char shards[];
+};
+
+#define vmap_shard_at(map, i)                                                  \
+    ((vmap_shard*)((map)->shards + ((i) * VMAP_SHARD_SIZE)))
+
+/* the shard comes from the top bits of a multiplicative mix of the hash, the
+ * shard's own table indexes with the low bits of the same hash */
+static inline vmap_shard* vmap_shard_for(vmap_sharded* map, uint64_t hash) {
+    if (map->shard_bits == 0) {
+        return vmap_shard_at(map, 0);
+    }
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return vmap_shard_at(map, hash >> (64 - map->shard_bits));
+}
+
+vmap_sharded* vmap_sharded_new(vmap_type* type, size_t num_shards) {
+    vmap_sharded* map;
+    size_t i;
+    uint64_t bits = 0;
+    /* shards allocate in parallel and the allocators are not thread safe */
+    if (type->allocator != NULL) {
+        return NULL;
+    }
+    while (((size_t)1 << bits) < num_shards) {
+        bits++;
+    }
+    num_shards = ((size_t)1 << bits);
+    map = vmap_malloc((sizeof *map) + (num_shards * VMAP_SHARD_SIZE));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->shard_bits = bits;
+    map->num_shards = num_shards;
+    map->hash = type->hash;
+    map->value_size = type->value_size;
+    for (i = 0; i < num_shards; ++i) {
+        vmap_shard* shard = vmap_shard_at(map, i);
+        /* every shard owns and frees its own copy of the type */
+        vmap_type* shard_type = vmap_malloc(sizeof *shard_type);
+        if (shard_type != NULL) {
+            memcpy(shard_type, type, sizeof *shard_type);
+            shard->map = vmap_new(shard_type);
+            if (shard->map == NULL) {
+                vmap_free(shard_type);
+            }
+        } else {
+            shard->map = NULL;
+        }
+        if (shard->map == NULL) {
+            map->num_shards = i;
+            vmap_sharded_delete(map);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    vmap_free(type);
+    return map;
+}
+
+void vmap_sharded_delete(vmap_sharded* map) {
+    size_t i;
+    for (i = 0; i < map->num_shards; ++i) {
+        vmap_shard* shard = vmap_shard_at(map, i);
+        pthread_mutex_destroy(&shard->lock);
+        vmap_delete(shard->map);
+    }
+    vmap_free(map);
+}
+
+int vmap_sharded_insert(vmap_sharded* map, void* key, void* value) {
+    uint64_t hash = map->hash(key);
+    vmap_shard* shard = vmap_shard_for(map, hash);
+    int res;
+    pthread_mutex_lock(&shard->lock);
+    res = vmap_insert_hashed(&shard->map, key, value, hash);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
+
+int vmap_sharded_find(vmap_sharded* map, const void* key, void* value) {
+    uint64_t hash = map->hash(key);
+    vmap_shard* shard = vmap_shard_for(map, hash);
+    const void* res;
+    pthread_mutex_lock(&shard->lock);
+    res = vmap_find_hashed(shard->map, key, hash);
+    if (res != NULL) {
+        memcpy(value, res, map->value_size);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return res != NULL ? VMAP_OK : VMAP_NO_KEY;
+}
+
+int vmap_sharded_erase(vmap_sharded* map, const void* key) {
+    uint64_t hash = map->hash(key);
+    vmap_shard* shard = vmap_shard_for(map, hash);
+    int res;
+    pthread_mutex_lock(&shard->lock);
+    res = vmap_erase_hashed(&shard->map, key, hash);
+    pthread_mutex_unlock(&shard->lock);
+    return res;
+}
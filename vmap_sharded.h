@@ -0,0 +1,23 @@
+#ifndef __VMAP_SHARDED_H__
+
+#define __VMAP_SHARDED_H__
+
+#include "vmap.h"
+
+/* splits keys by hash over independent vmaps, each behind its own mutex, so
+ * writers on different shards never wait on each other and a resize only
+ * stalls the shard it happens in. safe to call from any thread */
+typedef struct vmap_sharded vmap_sharded;
+
+/* num_shards is rounded up to a power of two. like vmap_new the map takes
+ * type on success and leaves it to the caller on failure. type->allocator
+ * must be NULL since shards allocate from several threads at once */
+vmap_sharded* vmap_sharded_new(vmap_type* type, size_t num_shards);
+void vmap_sharded_delete(vmap_sharded* map);
+int vmap_sharded_insert(vmap_sharded* map, void* key, void* value);
+/* copies the value out while the shard is locked, returns VMAP_NO_KEY when
+ * the key is not present */
+int vmap_sharded_find(vmap_sharded* map, const void* key, void* value);
+int vmap_sharded_erase(vmap_sharded* map, const void* key);
+
+#endif /* __VMAP_SHARDED_H__ */